@@ -0,0 +1,94 @@
+// Example DLC: colours numbers, string literals and // comments, and lints for trailing
+// whitespace on save. Ctrl-E toggles the highlighting.
+//
+//   make && RPGEDITOR_PLUGINS=./plugins/highlight.so ./rpgeditor file.c
+#include <ctype.h>
+#include <stddef.h>
+
+#include "../rpgeditor_plugin.h"
+
+#define CTRL_KEY(k) ((k) & 0x1f)
+
+enum highlightColor
+{
+    COLOR_STRING = 2,
+    COLOR_NUMBER = 3,
+    COLOR_COMMENT = 6,
+};
+
+static const rpg_host *host;
+static int enabled = 1;
+
+static void highlight_row(int row, const char *chars, int size, unsigned char *colors)
+{
+    (void)row;
+    if (!enabled)
+        return;
+
+    char quote = 0;
+    for (int j = 0; j < size; j++)
+    {
+        char c = chars[j];
+        if (quote)
+        {
+            colors[j] = COLOR_STRING;
+            if (c == '\\' && j + 1 < size)
+                colors[++j] = COLOR_STRING;
+            else if (c == quote)
+                quote = 0;
+        }
+        else if (c == '"' || c == '\'')
+        {
+            quote = c;
+            colors[j] = COLOR_STRING;
+        }
+        else if (c == '/' && j + 1 < size && chars[j + 1] == '/')
+        {
+            for (; j < size; j++)
+                colors[j] = COLOR_COMMENT;
+        }
+        else if (isdigit((unsigned char)c) && (j == 0 || !(isalnum((unsigned char)chars[j - 1]) || chars[j - 1] == '_')))
+        {
+            for (; j < size && (isalnum((unsigned char)chars[j]) || chars[j] == '.'); j++)
+                colors[j] = COLOR_NUMBER;
+            j--;
+        }
+    }
+}
+
+static int highlight_keypress(int key)
+{
+    if (key != CTRL_KEY('e'))
+        return 0;
+    enabled = !enabled;
+    host->set_status("Highlighting %s", enabled ? "on" : "off");
+    return 1;
+}
+
+static void lint_saved(const char *file_name)
+{
+    int count = 0, first = -1;
+    for (int j = 0; j < host->numrows(); j++)
+    {
+        int size;
+        const char *chars = host->row(j, &size);
+        if (size > 0 && (chars[size - 1] == ' ' || chars[size - 1] == '\t'))
+        {
+            if (first == -1)
+                first = j;
+            count++;
+        }
+    }
+    if (count)
+        host->set_status("%s: %d lines with trailing whitespace, first at %d", file_name, count, first + 1);
+}
+
+static const rpg_plugin plugin = {RPG_PLUGIN_ABI, "highlight", NULL, highlight_row, highlight_keypress, lint_saved};
+
+const rpg_plugin *rpg_plugin_init(const rpg_host *editor)
+{
+    if (editor->abi != RPG_PLUGIN_ABI)
+        return NULL;
+    host = editor;
+    return &plugin;
+}
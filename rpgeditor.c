@@ -13,16 +13,34 @@
 #include <string.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
+#include <stddef.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <sys/inotify.h>
+#include <limits.h>
+#include <dlfcn.h>
+#include <sys/mman.h>
+
+#include "rpgeditor_plugin.h"
 
 /*** custom defines ***/
 #define CTRL_KEY(k) ((k) & 0x1f)
 #define CURRENT_VERSION "0.5.1"
+#define TICK_MS 250
+#define STATUS_MSG_MS 5000
+#define MINIMAP_WIDTH 12
 
 /*** data ***/
 typedef struct editrow
 {
     int size;
     char *chars;
+    int gen;
+    unsigned char modified;
+    unsigned char interned;
 } editrow;
 
 struct inventory_struct
@@ -40,6 +58,86 @@ struct inventory_struct
 };
 struct inventory_struct inventory;
 
+typedef struct clipboard_struct
+{
+    char *text;
+    int len;
+} clipboard_struct;
+clipboard_struct clipboard;
+
+typedef struct reload_job reload_job;
+
+typedef struct file_watch
+{
+    int fd;
+    char *name;
+    long long size;
+    struct timespec mtime;
+    ino_t ino;
+    unsigned int tail_hash;
+    int tail_newline;
+
+    int follow;
+    int pending;
+    int conflict;
+    reload_job *reload;
+} file_watch;
+
+typedef struct line_summary
+{
+    long long rows;
+    long long bytes;
+    long long modified;
+    long long matches;
+} line_summary;
+
+typedef struct line_index
+{
+    line_summary *chunks;
+    line_summary *tree;
+    int nchunks;
+    int alloc;
+    int stale;
+} line_index;
+
+#define STATS_BUCKETS 32
+
+typedef struct doc_stats
+{
+    long long bytes;
+    long long words;
+    long long chars;
+    long long histogram[STATS_BUCKETS];
+    int longest;
+    int *exact;
+    int *long_rows;
+    int nlong;
+    int long_alloc;
+    int deferred;
+} doc_stats;
+
+typedef struct swap_journal swap_journal;
+typedef struct autosave_job autosave_job;
+
+typedef struct undo_journal
+{
+    unsigned char *data;
+    int len;
+    int alloc;
+    int limit;
+
+    int cursor;
+    int cursor_row;
+    int base_row;
+    int run_start;
+
+    int undo_entries;
+    int redo_entries;
+    int mute;
+    int group;
+    int group_records;
+} undo_journal;
+
 struct editorConfig
 {
     struct termios original_term_mode;
@@ -55,8 +153,41 @@ struct editorConfig
     editrow *rows;
 
     char *file_name;
+    // line endings are written back the way the file was read: CRLF if its first line ended so,
+    // and without a final newline if it had none
+    int crlf;
+    int no_final_newline;
+
+    int log_mute;
+    undo_journal journal;
+    swap_journal *swap;
+
+    long long edits;
+    long long saved_edits;
+    int save_errno;
+    long long failed_edits;
+    long long last_edit_ms;
+    int save_requested;
+    int snapshot_gen;
+    autosave_job *autosave;
+    long long autosave_started_ms;
+    time_t autosaved_at;
+    long long autosave_took_ms;
+
+    file_watch watch;
+    int line_cache;
+    line_index index;
+    doc_stats stats;
+    int loading;
+    char *search;
+    int mark_set;
+    int mark_row;
+    int mark_col;
+    char status_msg[80];
+    long long status_msg_ms;
 };
-struct editorConfig edit_conf;
+// Per thread so headless batch workers can each edit their own document with the same functions.
+__thread struct editorConfig edit_conf;
 
 typedef struct cache_buffer
 {
@@ -81,886 +212,5419 @@ enum editorKey
     DEL_KEY,
 };
 
-/*** functions ***/
+/*** undo journal ***/
 
-void editor_insert_row(char *s, size_t len, int pos)
+// Records are packed back to back as:
+//   type | zigzag(row - previous row) | col | len | len bytes | reversed varint of everything before it
+// so the journal can be walked forwards (redo, dropping old entries) and backwards (undo).
+#define JOURNAL_DEFAULT_LIMIT (1024 * 1024)
+// Set in the type byte of a record that undoes and redoes together with the one before it.
+#define JOURNAL_CHAINED 0x80
+
+enum journalOp
 {
-    if (pos < 0 || pos > edit_conf.numrows)
-        return;
-    edit_conf.rows = realloc(edit_conf.rows, sizeof(editrow) * (edit_conf.numrows + 1));
-    memmove(&edit_conf.rows[pos + 1], &edit_conf.rows[pos], sizeof(editrow) * (edit_conf.numrows - pos));
+    JOURNAL_INSERT_CHARS = 1,
+    JOURNAL_DEL_CHARS,
+    JOURNAL_INSERT_ROW,
+    JOURNAL_DEL_ROW,
+    JOURNAL_SPLIT_ROW,
+    JOURNAL_JOIN_ROW,
+    JOURNAL_APPEND,
+    JOURNAL_DEL_BLOCK,
+    JOURNAL_PUT_BLOCK,
+};
 
-    edit_conf.rows[pos].size = len;
-    edit_conf.rows[pos].chars = malloc(len + 1);
-    memcpy(edit_conf.rows[pos].chars, s, len);
-    edit_conf.rows[pos].chars[len] = '\0';
-    edit_conf.numrows++;
-}
+typedef struct journal_entry
+{
+    int type;
+    int chained;
+    int drow;
+    int row;
+    int col;
+    int len;
+    const char *bytes;
+    int size;
+} journal_entry;
 
-void editor_insert_newline()
+int varint_size(unsigned int value)
 {
-    int line_num = edit_conf.cy + edit_conf.row_offset;
-    if (edit_conf.cx == 0)
+    int size = 1;
+    while (value >= 0x80)
     {
-        editor_insert_row("", 0, line_num);
+        value >>= 7;
+        size++;
     }
-    else
+    return size;
+}
+
+int varint_put(unsigned char *out, unsigned int value)
+{
+    int i = 0;
+    while (value >= 0x80)
     {
-        editrow *row = &edit_conf.rows[line_num];
-        editor_insert_row(&row->chars[edit_conf.cx], row->size - edit_conf.cx, line_num + 1);
-        row = &edit_conf.rows[line_num];
-        row->size = edit_conf.cx;
-        row->chars[row->size] = '\0';
+        out[i++] = (value & 0x7f) | 0x80;
+        value >>= 7;
     }
-    edit_conf.cy++;
-    edit_conf.cx = 0;
+    out[i++] = value;
+    return i;
 }
 
-void editor_row_insert_char(editrow *row, int position, int chr)
+int varint_get(const unsigned char *in, unsigned int *value)
 {
-    if (position < 0 || position > row->size)
-        position = row->size;
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[position + 1], &row->chars[position], row->size - position + 1);
-    row->size++;
-    row->chars[position] = chr;
+    int i = 0;
+    int shift = 0;
+    *value = 0;
+    do
+    {
+        *value |= (unsigned int)(in[i] & 0x7f) << shift;
+        shift += 7;
+    } while (in[i++] & 0x80);
+    return i;
 }
 
-void editor_insert_char(int chr)
+int varint_put_reversed(unsigned char *out, unsigned int value)
 {
-    if (edit_conf.cy + edit_conf.row_offset == edit_conf.numrows)
+    unsigned char tmp[5];
+    int size = varint_put(tmp, value);
+    for (int i = 0; i < size; i++)
     {
-        editor_insert_row("", 0, edit_conf.numrows);
+        out[i] = tmp[size - 1 - i];
     }
-    editor_row_insert_char(&edit_conf.rows[edit_conf.cy + edit_conf.row_offset], edit_conf.cx, chr);
-    edit_conf.cx++;
+    return size;
 }
 
-void editor_row_del_char(editrow *row, int position)
+// Reads a varint written by varint_put_reversed that ends just before `end`.
+int varint_get_reversed(const unsigned char *end, unsigned int *value)
 {
-    if (position < 0 || position >= row->size)
-        return;
-    memmove(&row->chars[position], &row->chars[position + 1], row->size - position);
-    row->size--;
+    int i = 0;
+    int shift = 0;
+    *value = 0;
+    do
+    {
+        i++;
+        *value |= (unsigned int)(end[-i] & 0x7f) << shift;
+        shift += 7;
+    } while (end[-i] & 0x80);
+    return i;
 }
 
-void editor_row_append_string(editrow *row, char *s, size_t len)
+unsigned int zigzag_encode(int value)
 {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
+    return ((unsigned int)value << 1) ^ (unsigned int)(value < 0 ? -1 : 0);
 }
 
-void editor_del_row(int position)
+int zigzag_decode(unsigned int value)
 {
-    if (position < 0 || position >= edit_conf.numrows)
-        return;
-    editrow *row = &edit_conf.rows[position];
-    free(row->chars);
-    memmove(&edit_conf.rows[position], &edit_conf.rows[position + 1], sizeof(editrow) * (edit_conf.numrows - position - 1));
-    edit_conf.numrows--;
+    return (int)(value >> 1) ^ -(int)(value & 1);
 }
 
-void editor_del_char()
+int journal_body_size(int drow, int col, int len)
 {
-    if (edit_conf.cy == edit_conf.numrows)
-        return;
-    if (edit_conf.cx == 0 && edit_conf.cy == 0)
+    return 1 + varint_size(zigzag_encode(drow)) + varint_size(col) + varint_size(len) + len;
+}
+
+int journal_encode(unsigned char *out, int type, int drow, int col, const char *bytes, int len)
+{
+    int pos = 0;
+    out[pos++] = type;
+    pos += varint_put(&out[pos], zigzag_encode(drow));
+    pos += varint_put(&out[pos], col);
+    pos += varint_put(&out[pos], len);
+    memcpy(&out[pos], bytes, len);
+    pos += len;
+    pos += varint_put_reversed(&out[pos], pos);
+    return pos;
+}
+
+int journal_decode(const unsigned char *in, journal_entry *entry)
+{
+    unsigned int value;
+    int pos = 0;
+    entry->type = in[pos] & ~JOURNAL_CHAINED;
+    entry->chained = (in[pos++] & JOURNAL_CHAINED) != 0;
+    pos += varint_get(&in[pos], &value);
+    entry->drow = zigzag_decode(value);
+    pos += varint_get(&in[pos], &value);
+    entry->col = value;
+    pos += varint_get(&in[pos], &value);
+    entry->len = value;
+    entry->bytes = (const char *)&in[pos];
+    pos += entry->len;
+    entry->size = pos + varint_size(pos);
+    return entry->size;
+}
+
+void journal_clear(undo_journal *j)
+{
+    j->len = 0;
+    j->cursor = 0;
+    j->cursor_row = 0;
+    j->base_row = 0;
+    j->run_start = -1;
+    j->undo_entries = 0;
+    j->redo_entries = 0;
+}
+
+void journal_init(undo_journal *j)
+{
+    j->data = NULL;
+    j->alloc = 0;
+    j->limit = JOURNAL_DEFAULT_LIMIT;
+    j->mute = 0;
+    j->group = 0;
+
+    char *limit_kb = getenv("RPGEDITOR_UNDO_KB");
+    if (limit_kb)
+        j->limit = atoi(limit_kb) * 1024;
+    journal_clear(j);
+}
+
+void journal_reserve(undo_journal *j, int needed)
+{
+    if (needed <= j->alloc)
         return;
+    int alloc = j->alloc ? j->alloc : 4096;
+    while (alloc < needed)
+        alloc *= 2;
+    if (alloc > j->limit && needed <= j->limit)
+        alloc = j->limit;
+    j->data = realloc(j->data, alloc);
+    j->alloc = alloc;
+}
 
-    editrow *row = &edit_conf.rows[edit_conf.cy];
-    if (edit_conf.cx > 0)
-    {
-        editor_row_del_char(row, edit_conf.cx - 1);
-        edit_conf.cx--;
-    }
-    else
+// Makes room for `needed` more bytes under the memory cap by forgetting the oldest records.
+void journal_drop_oldest(undo_journal *j, int needed)
+{
+    int drop = 0;
+    int base_row = j->base_row;
+    while (drop < j->len && j->len - drop + needed > j->limit)
     {
-        int new_x = edit_conf.rows[edit_conf.cy - 1].size;
-        if (new_x > edit_conf.screen_cols - 1)
-            new_x = edit_conf.screen_cols - 1;
-        edit_conf.cx = new_x;
-        editor_row_append_string(&edit_conf.rows[edit_conf.cy - 1], row->chars, row->size);
-        editor_del_row(edit_conf.cy);
-        edit_conf.cy--;
+        journal_entry entry;
+        drop += journal_decode(&j->data[drop], &entry);
+        base_row += entry.drow;
+        j->undo_entries--;
     }
+    if (drop == 0)
+        return;
+
+    memmove(j->data, &j->data[drop], j->len - drop);
+    j->len -= drop;
+    j->cursor -= drop;
+    j->base_row = base_row;
+    j->run_start = j->run_start >= drop ? j->run_start - drop : -1;
 }
 
-void cb_append(cache_buffer *cb, const char *s, int len)
+// Typing consecutive characters grows the last INSERT_CHARS record instead of adding a new one.
+int journal_extend_run(undo_journal *j, int row, int col, const char *bytes, int len)
 {
-    char *new = realloc(cb->cbuffer, cb->len + len);
-    if (new == NULL)
-        return;
-    memcpy(&new[cb->len], s, len);
-    cb->cbuffer = new;
-    cb->len += len;
+    if (j->run_start < 0 || row != j->cursor_row)
+        return 0;
+
+    journal_entry run;
+    journal_decode(&j->data[j->run_start], &run);
+    if (run.type != JOURNAL_INSERT_CHARS || run.col + run.len != col)
+        return 0;
+    if (varint_size(run.len) != varint_size(run.len + len))
+        return 0;
+
+    int body = journal_body_size(run.drow, run.col, run.len + len);
+    int size = body + varint_size(body);
+    if (j->run_start + size > j->limit)
+        return 0;
+    journal_reserve(j, j->run_start + size);
+
+    unsigned char *record = &j->data[j->run_start];
+    int len_at = 1 + varint_size(zigzag_encode(run.drow)) + varint_size(run.col);
+    varint_put(&record[len_at], run.len + len);
+    memcpy(&record[body - len], bytes, len);
+    varint_put_reversed(&record[body], body);
+
+    j->len = j->cursor = j->run_start + size;
+    return 1;
 }
-void cb_free(cache_buffer *cb)
+
+// Everything recorded until the matching journal_group_end is a single undo step.
+void journal_group_begin()
 {
-    free(cb->cbuffer);
+    if (edit_conf.journal.group++ == 0)
+        edit_conf.journal.group_records = 0;
 }
 
-int get_window_size(int *rows, int *cols)
+void journal_group_end()
 {
-    struct winsize ws;
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+    edit_conf.journal.group--;
+}
+
+void journal_record(int type, int row, int col, const char *bytes, int len)
+{
+    undo_journal *j = &edit_conf.journal;
+    if (j->mute || j->limit <= 0)
+        return;
+    int chained = j->group && j->group_records++ > 0;
+
+    j->len = j->cursor;
+    j->redo_entries = 0;
+
+    if (type == JOURNAL_INSERT_CHARS && journal_extend_run(j, row, col, bytes, len))
+        return;
+
+    int drow = row - j->cursor_row;
+    int body = journal_body_size(drow, col, len);
+    int size = body + varint_size(body);
+    if (size > j->limit)
     {
-        return -1;
+        journal_clear(j);
+        return;
     }
-    else
+    journal_drop_oldest(j, size);
+    journal_reserve(j, j->len + size);
+
+    journal_encode(&j->data[j->len], chained ? type | JOURNAL_CHAINED : type, drow, col, bytes, len);
+    j->run_start = type == JOURNAL_INSERT_CHARS ? j->len : -1;
+    j->len += size;
+    j->cursor = j->len;
+    j->cursor_row = row;
+    j->undo_entries++;
+}
+
+/*** swap journal ***/
+
+// Every edit is also appended to ".<file>.rpgswp" in the undo journal record format. A writer
+// thread batches records into one write() every SWAP_FLUSH_MS and fdatasync()s at most every
+// SWAP_SYNC_MS, so the main loop only ever copies a few bytes under a mutex.
+#define SWAP_MAGIC "RPGSWP1\n"
+#define SWAP_FLUSH_MS 200
+#define SWAP_SYNC_MS 1000
+#define SWAP_BATCH_BYTES (64 * 1024)
+
+typedef struct swap_header
+{
+    char magic[8];
+    long long base_size;
+    long long base_mtime_sec;
+    long long base_mtime_nsec;
+    long long start_row;
+} swap_header;
+
+struct swap_journal
+{
+    int fd;
+    char *path;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+
+    unsigned char *pending;
+    int pending_len;
+    int pending_alloc;
+    int last_row;
+    long long logged;
+
+    int reset;
+    long long reset_keep;
+    swap_header header;
+    int start_row;
+    int stop;
+};
+
+long long monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+void swap_header_for(swap_header *header, struct stat *st, int start_row)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, SWAP_MAGIC, sizeof(header->magic));
+    header->base_size = st->st_size;
+    header->base_mtime_sec = st->st_mtim.tv_sec;
+    header->base_mtime_nsec = st->st_mtim.tv_nsec;
+    header->start_row = start_row;
+}
+
+// Sidecar files sit next to the file as ".<file>.<ext>".
+char *sidecar_path(const char *file_name, const char *ext)
+{
+    const char *base = strrchr(file_name, '/');
+    int dir_len = base ? base - file_name + 1 : 0;
+    base = base ? base + 1 : file_name;
+
+    int len = dir_len + strlen(base) + strlen(ext) + 3;
+    char *path = malloc(len);
+    snprintf(path, len, "%.*s.%s.%s", dir_len, file_name, base, ext);
+    return path;
+}
+
+void swap_wait(swap_journal *swap, long long deadline)
+{
+    if (deadline < 0)
     {
-        *cols = ws.ws_col;
-        *rows = ws.ws_row;
-        return 0;
+        pthread_cond_wait(&swap->wake, &swap->lock);
+        return;
     }
+    long long now = monotonic_ms();
+    if (deadline <= now)
+        return;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    long long ns = ts.tv_nsec + (deadline - now) * 1000000;
+    ts.tv_sec += ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    pthread_cond_timedwait(&swap->wake, &swap->lock, &ts);
 }
 
-char *parse_line(char *input, int input_len, int *len_out)
+void *swap_writer(void *arg)
 {
-    int tabs = 0;
-    for (int i = 0; i < input_len; i++)
+    swap_journal *swap = arg;
+    unsigned char *batch = NULL;
+    int batch_alloc = 0;
+    long long flush_at = -1;
+    long long synced_at = monotonic_ms();
+    long long flushed = 0;
+    int unsynced = 0;
+
+    pthread_mutex_lock(&swap->lock);
+    while (1)
     {
-        if (input[i] == '\t')
+        long long now = monotonic_ms();
+        if (swap->pending_len && flush_at < 0)
+            flush_at = now + SWAP_FLUSH_MS;
+
+        int flush = swap->reset || swap->stop || swap->pending_len >= SWAP_BATCH_BYTES ||
+                    (flush_at >= 0 && now >= flush_at);
+        int sync = unsynced && (swap->stop || now >= synced_at + SWAP_SYNC_MS);
+        if (!flush && !sync)
         {
-            tabs++;
+            long long deadline = flush_at;
+            if (unsynced && (deadline < 0 || synced_at + SWAP_SYNC_MS < deadline))
+                deadline = synced_at + SWAP_SYNC_MS;
+            swap_wait(swap, deadline);
+            continue;
         }
-    }
-    int new_len = input_len + 3 * tabs;
-    char *output = malloc(new_len);
-    int diff = 0;
-    for (int i = 0; i < input_len; i++)
-    {
-        if (input[i] == '\t')
+
+        unsigned char *records = swap->pending;
+        int records_alloc = swap->pending_alloc;
+        int records_len = swap->pending_len;
+        swap->pending = batch;
+        swap->pending_alloc = batch_alloc;
+        swap->pending_len = 0;
+        batch = records;
+        batch_alloc = records_alloc;
+        int reset = swap->reset;
+        long long keep = swap->reset_keep;
+        swap_header header = swap->header;
+        int stop = swap->stop;
+        swap->reset = 0;
+        swap->reset_keep = 0;
+        flush_at = -1;
+        pthread_mutex_unlock(&swap->lock);
+
+        int skip = 0;
+        if (reset)
         {
-            for (int j = 0; j < 4; j++)
+            // records past `keep` were logged after the snapshot that is now on disk
+            char *tail = NULL;
+            int tail_len = keep < flushed ? flushed - keep : 0;
+            if (tail_len)
             {
-                output[i + diff] = ' ';
-                diff++;
+                tail = malloc(tail_len);
+                if (pread(swap->fd, tail, tail_len, sizeof(header) + keep) != tail_len)
+                    tail_len = 0;
             }
-            diff--;
+            if (ftruncate(swap->fd, 0) == 0 && write(swap->fd, &header, sizeof(header)) > 0)
+                unsynced = 1;
+            if (tail_len)
+                unsynced |= write(swap->fd, tail, tail_len) > 0;
+            free(tail);
+
+            skip = keep > flushed ? keep - flushed : 0;
+            flushed = tail_len;
         }
-        else
+        if (records_len > skip)
         {
-            output[i + diff] = input[i];
+            unsynced |= write(swap->fd, &records[skip], records_len - skip) > 0;
+            flushed += records_len - skip;
+        }
+        if (unsynced && (stop || monotonic_ms() >= synced_at + SWAP_SYNC_MS))
+        {
+            fdatasync(swap->fd);
+            synced_at = monotonic_ms();
+            unsynced = 0;
         }
+
+        pthread_mutex_lock(&swap->lock);
+        if (stop && !swap->pending_len)
+            break;
     }
-    *len_out = new_len;
-    return output;
+    pthread_mutex_unlock(&swap->lock);
+    free(batch);
+    return NULL;
 }
 
-void render_editor(cache_buffer *cbuf)
+void swap_record(int type, int row, int col, const char *bytes, int len)
 {
-    for (int y = 0; y < edit_conf.screen_rows; y++)
+    swap_journal *swap = edit_conf.swap;
+    if (!swap)
+        return;
+
+    int drow = row - swap->last_row;
+    int body = journal_body_size(drow, col, len);
+    int size = body + varint_size(body);
+
+    pthread_mutex_lock(&swap->lock);
+    if (swap->pending_len + size > swap->pending_alloc)
     {
-        int filerow = y + edit_conf.row_offset;
-        if (filerow >= edit_conf.numrows)
-        {
-            if (y == 2 && edit_conf.numrows == 0)
-            {
-                char welcome[80];
-                int welcome_len = snprintf(welcome, sizeof(welcome), "RPGEditor version %s", CURRENT_VERSION);
-                if (welcome_len > edit_conf.screen_cols)
-                    welcome_len = edit_conf.screen_cols;
+        int alloc = swap->pending_alloc ? swap->pending_alloc : 4096;
+        while (alloc < swap->pending_len + size)
+            alloc *= 2;
+        swap->pending = realloc(swap->pending, alloc);
+        swap->pending_alloc = alloc;
+    }
+    journal_encode(&swap->pending[swap->pending_len], type, drow, col, bytes, len);
+    int was_empty = swap->pending_len == 0;
+    swap->pending_len += size;
+    swap->logged += size;
+    if (was_empty || swap->pending_len >= SWAP_BATCH_BYTES)
+        pthread_cond_signal(&swap->wake);
+    pthread_mutex_unlock(&swap->lock);
 
-                int padding = (edit_conf.screen_cols - welcome_len) / 2;
+    swap->last_row = row;
+}
 
-                if (padding)
-                {
-                    cb_append(cbuf, "~", 1);
-                    padding--;
-                }
-                while (padding--)
-                {
-                    cb_append(cbuf, " ", 1);
-                }
+// Position in the swap of everything logged so far, for a later swap_rebase.
+long long swap_mark(int *row)
+{
+    swap_journal *swap = edit_conf.swap;
+    *row = swap ? swap->last_row : 0;
+    return swap ? swap->logged : 0;
+}
 
-                cb_append(cbuf, welcome, welcome_len);
-            }
+// The first `keep` logged bytes are now part of the file on disk described by `st`; restart the
+// swap on top of it with only the records logged after that point.
+void swap_rebase(struct stat *st, long long keep, int start_row)
+{
+    swap_journal *swap = edit_conf.swap;
+    if (!swap)
+        return;
+    pthread_mutex_lock(&swap->lock);
+    swap_header_for(&swap->header, st, start_row);
+    swap->start_row = start_row;
+    swap->reset = 1;
+    swap->reset_keep += keep;
+    swap->logged -= keep;
+    pthread_cond_signal(&swap->wake);
+    pthread_mutex_unlock(&swap->lock);
+}
 
-            else
-            {
-                cb_append(cbuf, "~", 1);
-            }
-        }
-        else
-        {
-            int len = edit_conf.rows[filerow].size;
-            if (len > edit_conf.screen_cols)
-                len = edit_conf.screen_cols;
-            int out_len = 0;
-            char *parsed = parse_line(edit_conf.rows[filerow].chars, len, &out_len);
-            cb_append(cbuf, parsed, out_len);
-        }
+void swap_close(int discard)
+{
+    swap_journal *swap = edit_conf.swap;
+    if (!swap)
+        return;
+    pthread_mutex_lock(&swap->lock);
+    swap->stop = 1;
+    if (discard)
+        swap->pending_len = 0;
+    pthread_cond_signal(&swap->wake);
+    pthread_mutex_unlock(&swap->lock);
+    pthread_join(swap->thread, NULL);
 
-        cb_append(cbuf, "\x1b[K", 3);
+    close(swap->fd);
+    if (discard)
+        unlink(swap->path);
+    free(swap->path);
+    free(swap->pending);
+    pthread_mutex_destroy(&swap->lock);
+    pthread_cond_destroy(&swap->wake);
+    free(swap);
+    edit_conf.swap = NULL;
+}
 
-        cb_append(cbuf, "\r\n", 2);
-    }
-    write(STDOUT_FILENO, "\x1b[H", 3);
+// The file on disk changed underneath the logged records without invalidating them (it was only
+// appended to), so keep every record and just point the header at the new base.
+void swap_restat(struct stat *st)
+{
+    if (edit_conf.swap)
+        swap_rebase(st, 0, edit_conf.swap->start_row);
 }
 
-void render_status_bar(cache_buffer *cbuf)
+void editor_log_edit(int type, int row, int col, const char *bytes, int len)
 {
-    cb_append(cbuf, "\x1b[7m", 4);
-    char status[40], r_status[40];
+    if (edit_conf.log_mute)
+        return;
+    journal_record(type, row, col, bytes, len);
+    swap_record(type, row, col, bytes, len);
+    edit_conf.edits++;
+    edit_conf.last_edit_ms = monotonic_ms();
+}
 
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines",
-                       edit_conf.file_name ? edit_conf.file_name : "[No Name]", edit_conf.numrows);
+/*** line index ***/
 
-    int rlen = snprintf(r_status, sizeof(r_status), "%d/%d",
-                        edit_conf.cy + 1 + edit_conf.row_offset, edit_conf.numrows);
+// Rows are grouped into chunks of LINE_INDEX_CHUNK to twice that many rows, and a Fenwick tree
+// over the chunk summaries answers "bytes before row n" and "row at byte offset x" in O(log n)
+// plus one chunk scan. Chunks count their own rows, so an edit only touches the chunks it lands
+// in: a row edit updates one, and a splice summarises the rows it inserts, drops the chunks it
+// deletes whole without reading them, and rebuilds the tree, which is plain additions over the
+// chunks. A chunk that grows too long is split and one that shrinks too far joins a neighbour.
+// Loading marks the index stale instead, and the first query counts it.
+#define LINE_INDEX_CHUNK 64
 
-    if (len > edit_conf.screen_cols)
-        len = edit_conf.screen_cols;
-    cb_append(cbuf, status, len);
+int row_count_matches(editrow *row)
+{
+    if (!edit_conf.search)
+        return 0;
+    int len = strlen(edit_conf.search);
+    int matches = 0;
+    char *end = &row->chars[row->size];
+    for (char *p = row->chars; (p = memmem(p, end - p, edit_conf.search, len)) != NULL; p += len)
+        matches++;
+    return matches;
+}
 
-    while (len < edit_conf.screen_cols)
+line_summary row_summary(editrow *row)
+{
+    line_summary sum;
+    sum.rows = 1;
+    sum.bytes = row->size + 1;
+    sum.modified = row->modified;
+    sum.matches = row_count_matches(row);
+    return sum;
+}
+
+void summary_add(line_summary *to, line_summary *from, int sign)
+{
+    to->rows += sign * from->rows;
+    to->bytes += sign * from->bytes;
+    to->modified += sign * from->modified;
+    to->matches += sign * from->matches;
+}
+
+// Summary of rows [from, to), one row at a time.
+line_summary line_index_scan(int from, int to)
+{
+    line_summary sum = {0};
+    for (int j = from; j < to; j++)
     {
-        if (edit_conf.screen_cols - len == rlen)
-        {
-            cb_append(cbuf, r_status, rlen);
-            break;
-        }
-        else
-        {
-            cb_append(cbuf, " ", 1);
-            len++;
-        }
+        line_summary row = row_summary(&edit_conf.rows[j]);
+        summary_add(&sum, &row, 1);
     }
-    cb_append(cbuf, "\x1b[m", 3);
+    return sum;
 }
 
-void render_inventory_options(cache_buffer *cbuf, int status)
+void line_index_tree_add(line_index *ix, int chunk, line_summary *sum, int sign)
 {
-    switch (status)
+    for (int i = chunk + 1; i <= ix->nchunks; i += i & -i)
+        summary_add(&ix->tree[i - 1], sum, sign);
+}
+
+// Summary of chunks [0, chunk).
+line_summary line_index_tree_prefix(line_index *ix, int chunk)
+{
+    line_summary sum = {0};
+    for (int i = chunk; i > 0; i -= i & -i)
+        summary_add(&sum, &ix->tree[i - 1], 1);
+    return sum;
+}
+
+void line_index_resize(line_index *ix, int nchunks)
+{
+    if (nchunks > ix->alloc)
     {
-    case 0:
-        cb_append(cbuf, "BUY\r\n", 6);
-        break;
-    case 1:
-        cb_append(cbuf, "EQUIP\r\n", 8);
-        break;
-    case 2:
-        cb_append(cbuf, "EQUIPPED\r\n", 10);
-        break;
+        ix->alloc = nchunks * 2;
+        ix->chunks = realloc(ix->chunks, sizeof(line_summary) * ix->alloc);
+        ix->tree = realloc(ix->tree, sizeof(line_summary) * ix->alloc);
     }
 }
 
-void render_inventory(cache_buffer *cbuf)
+void line_index_build_tree(line_index *ix)
 {
-    cb_append(cbuf, "---INVENTORY---\r\n", 17);
-    cb_append(cbuf, "\r\n", 2);
-    cb_append(cbuf, "WEAPONS:\r\n", 11);
+    memcpy(ix->tree, ix->chunks, sizeof(line_summary) * ix->nchunks);
+    for (int i = 1; i <= ix->nchunks; i++)
+    {
+        int parent = i + (i & -i);
+        if (parent <= ix->nchunks)
+            summary_add(&ix->tree[parent - 1], &ix->tree[i - 1], 1);
+    }
+}
 
-    cb_append(cbuf, "  STAFF OF INSERTION - ", 23);
-    render_inventory_options(cbuf, inventory.insert);
+// Chunk holding row `pos`, with the row it starts at in `start`; `pos` == numrows falls in the
+// last chunk.
+int line_index_find(line_index *ix, int pos, int *start)
+{
+    int chunk = 0;
+    long long row = 0;
+    int step = 1;
+    while (step * 2 <= ix->nchunks)
+        step *= 2;
+    for (; step > 0; step /= 2)
+    {
+        if (chunk + step <= ix->nchunks && row + ix->tree[chunk + step - 1].rows <= pos)
+        {
+            chunk += step;
+            row += ix->tree[chunk - 1].rows;
+        }
+    }
+    if (chunk == ix->nchunks && chunk > 0)
+    {
+        chunk--;
+        row -= ix->chunks[chunk].rows;
+    }
+    *start = row;
+    return chunk;
+}
 
-    cb_append(cbuf, "  SWORD OF REMOVAL - ", 21);
-    render_inventory_options(cbuf, inventory.delete);
+// Replaces `count` chunks at `chunk`, which hold rows [from, to), with LINE_INDEX_CHUNK-row
+// ones. The caller rebuilds the tree.
+void line_index_rechunk(line_index *ix, int chunk, int count, int from, int to)
+{
+    int n = (to - from + LINE_INDEX_CHUNK - 1) / LINE_INDEX_CHUNK;
+    line_index_resize(ix, ix->nchunks - count + n);
+    memmove(&ix->chunks[chunk + n], &ix->chunks[chunk + count],
+            sizeof(line_summary) * (ix->nchunks - chunk - count));
+    ix->nchunks += n - count;
+    for (int i = 0; i < n; i++)
+    {
+        int end = from + (i + 1) * LINE_INDEX_CHUNK < to ? from + (i + 1) * LINE_INDEX_CHUNK : to;
+        ix->chunks[chunk + i] = line_index_scan(from + i * LINE_INDEX_CHUNK, end);
+    }
+}
 
-    cb_append(cbuf, "  BOW OF COMMAND - ", 19);
-    render_inventory_options(cbuf, inventory.command);
+// Folds chunk + 1 into `chunk` when either has run short and together they still fit; returns
+// whether it did.
+int line_index_merge(line_index *ix, int chunk)
+{
+    if (chunk < 0 || chunk + 1 >= ix->nchunks)
+        return 0;
+    line_summary *a = &ix->chunks[chunk], *b = &ix->chunks[chunk + 1];
+    if ((a->rows >= LINE_INDEX_CHUNK / 2 && b->rows >= LINE_INDEX_CHUNK / 2) ||
+        a->rows + b->rows >= 2 * LINE_INDEX_CHUNK)
+        return 0;
+    summary_add(a, b, 1);
+    memmove(b, b + 1, sizeof(line_summary) * (ix->nchunks - chunk - 2));
+    ix->nchunks--;
+    return 1;
+}
 
-    cb_append(cbuf, "\r\n", 2);
-    cb_append(cbuf, "OTHER:\r\n", 8);
+void line_index_invalidate()
+{
+    edit_conf.index.stale = 1;
+}
 
-    cb_append(cbuf, "  FAST TRAVEL - ", 16);
-    render_inventory_options(cbuf, inventory.fast_travel);
+// Counts a stale index from scratch; otherwise the index is always current.
+void line_index_refresh()
+{
+    line_index *ix = &edit_conf.index;
+    if (!ix->stale)
+        return;
+    ix->nchunks = 0;
+    line_index_rechunk(ix, 0, 0, 0, edit_conf.numrows);
+    line_index_build_tree(ix);
+    ix->stale = 0;
+}
 
-    cb_append(cbuf, "  HELMET - ", 11);
-    render_inventory_options(cbuf, inventory.helmet);
+// Row `pos` changed in place; `before` is its summary from before the change.
+void line_index_update(int pos, line_summary *before)
+{
+    line_index *ix = &edit_conf.index;
+    if (ix->stale)
+        return;
+    int start;
+    int chunk = line_index_find(ix, pos, &start);
+    line_summary after = row_summary(&edit_conf.rows[pos]);
+    summary_add(&after, before, -1);
+    summary_add(&ix->chunks[chunk], &after, 1);
+    line_index_tree_add(ix, chunk, &after, 1);
 }
-void inventory_handle_enter()
+
+// Called after `count` rows were inserted at `pos`. They join the chunk they landed in, which is
+// cut up afresh once that takes it to twice LINE_INDEX_CHUNK rows.
+void line_index_inserted(int pos, int count)
 {
-    switch (edit_conf.cy)
+    line_index *ix = &edit_conf.index;
+    if (ix->stale || count == 0)
+        return;
+    int start;
+    int chunk = line_index_find(ix, pos, &start);
+    int rows = ix->nchunks ? ix->chunks[chunk].rows : 0;
+    if (rows + count >= 2 * LINE_INDEX_CHUNK || ix->nchunks == 0)
     {
-    case 3:
-        inventory.insert = 2;
-        inventory.command = 1;
-        inventory.delete = 1;
-        break;
-    case 4:
-        inventory.insert = 1;
-        inventory.command = 1;
-        inventory.delete = 2;
-        break;
-    case 5:
-        inventory.insert = 1;
-        inventory.command = 2;
-        inventory.delete = 1;
-        break;
-    case 8:
-        inventory.fast_travel++;
-        if (inventory.fast_travel == 3)
-            inventory.fast_travel = 1;
-        break;
-    case 9:
-        inventory.helmet++;
-        if (inventory.helmet == 3)
-            inventory.helmet = 1;
-        break;
+        line_index_rechunk(ix, chunk, ix->nchunks ? 1 : 0, start, start + rows + count);
+        line_index_build_tree(ix);
+        return;
     }
+    line_summary added = line_index_scan(pos, pos + count);
+    summary_add(&ix->chunks[chunk], &added, 1);
+    line_index_tree_add(ix, chunk, &added, 1);
 }
 
-void refresh_screen()
+// Called before rows [pos, pos + count) are removed. Chunks inside the range are dropped without
+// reading their rows; only the chunks at either end scan the rows they lose.
+void line_index_removing(int pos, int count)
 {
-    cache_buffer cb = CBUFFER_INIT;
+    line_index *ix = &edit_conf.index;
+    if (ix->stale || count == 0)
+        return;
+    int start;
+    int first = line_index_find(ix, pos, &start);
+    int chunk = first;
+    for (int end = pos + count; start < end; chunk++)
+    {
+        int stop = start + ix->chunks[chunk].rows;
+        if (start < pos || stop > end)
+        {
+            line_summary gone = line_index_scan(start > pos ? start : pos, stop < end ? stop : end);
+            summary_add(&ix->chunks[chunk], &gone, -1);
+        }
+        else
+        {
+            ix->chunks[chunk].rows = 0;
+        }
+        start = stop;
+    }
 
-    cb_append(&cb, "\x1b[?25l", 6);
-    cb_append(&cb, "\x1b[H", 3);
+    int kept = first;
+    for (int c = first; c < chunk; c++)
+    {
+        if (ix->chunks[c].rows)
+            ix->chunks[kept++] = ix->chunks[c];
+    }
+    memmove(&ix->chunks[kept], &ix->chunks[chunk], sizeof(line_summary) * (ix->nchunks - chunk));
+    ix->nchunks -= chunk - kept;
+    line_index_merge(ix, first);
+    line_index_merge(ix, first - 1);
+    line_index_build_tree(ix);
+}
 
-    if (inventory.active == 1)
+// Called after the row at `pos`, summarised by `removed`, was deleted.
+void line_index_deleted(int pos, line_summary *removed)
+{
+    line_index *ix = &edit_conf.index;
+    if (ix->stale)
+        return;
+    int start;
+    // the tree still counts the row, so `pos` is found where it was
+    int chunk = line_index_find(ix, pos, &start);
+    summary_add(&ix->chunks[chunk], removed, -1);
+    if (ix->chunks[chunk].rows == 0)
     {
-        cb_append(&cb, "\x1b[2J", 4);
-        render_inventory(&cb);
+        memmove(&ix->chunks[chunk], &ix->chunks[chunk + 1], sizeof(line_summary) * (ix->nchunks - chunk - 1));
+        ix->nchunks--;
+        line_index_merge(ix, chunk - 1);
     }
-    else
+    else if (!line_index_merge(ix, chunk) && !line_index_merge(ix, chunk - 1))
     {
-        render_editor(&cb);
-        render_status_bar(&cb);
+        line_index_tree_add(ix, chunk, removed, -1);
+        return;
     }
+    line_index_build_tree(ix);
+}
 
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", edit_conf.cy + 1, edit_conf.cx + 1);
-    cb_append(&cb, buf, strlen(buf));
-    cb_append(&cb, "\x1b[?25h", 6);
+// Clears every row's modified flag, visiting only the chunks that hold a modified row.
+void line_index_clear_modified()
+{
+    line_index *ix = &edit_conf.index;
+    if (ix->stale)
+    {
+        for (int j = 0; j < edit_conf.numrows; j++)
+            edit_conf.rows[j].modified = 0;
+        return;
+    }
+    int start = 0;
+    int cleared = 0;
+    for (int c = 0; c < ix->nchunks; start += ix->chunks[c++].rows)
+    {
+        if (!ix->chunks[c].modified)
+            continue;
+        for (int j = start; j < start + ix->chunks[c].rows; j++)
+            edit_conf.rows[j].modified = 0;
+        ix->chunks[c].modified = 0;
+        cleared = 1;
+    }
+    if (cleared)
+        line_index_build_tree(ix);
+}
 
-    write(STDOUT_FILENO, cb.cbuffer, cb.len);
-    cb_free(&cb);
+line_summary line_index_total()
+{
+    line_index_refresh();
+    return line_index_tree_prefix(&edit_conf.index, edit_conf.index.nchunks);
 }
 
-void die(const char *s)
+// Summary of rows [0, pos): the chunks before the one holding `pos`, and that chunk's rows up to it.
+line_summary line_index_prefix(int pos)
 {
-    refresh_screen();
-    perror(s);
-    exit(1);
+    int start;
+    int chunk = line_index_find(&edit_conf.index, pos, &start);
+    line_summary sum = line_index_tree_prefix(&edit_conf.index, chunk);
+    line_summary part = line_index_scan(start, pos);
+    summary_add(&sum, &part, 1);
+    return sum;
 }
 
-void editor_open(char *file_name)
+// Summary of rows [from, to) in O(log n) plus two partial chunk scans; short ranges are scanned.
+line_summary line_index_range(int from, int to)
 {
-    free(edit_conf.file_name);
-    edit_conf.file_name = strdup(file_name);
+    if (to - from <= 2 * LINE_INDEX_CHUNK)
+        return line_index_scan(from, to);
+    line_index_refresh();
+    line_summary sum = line_index_prefix(to);
+    line_summary before = line_index_prefix(from);
+    summary_add(&sum, &before, -1);
+    return sum;
+}
 
-    FILE *fp = fopen(file_name, "r");
-    if (!fp)
-        die("fopen");
+// Summary of whole chunks [from, to), with the row the first one starts at in `row`.
+line_summary line_index_chunks(int from, int to, int *row)
+{
+    line_summary sum = line_index_tree_prefix(&edit_conf.index, to);
+    line_summary before = line_index_tree_prefix(&edit_conf.index, from);
+    summary_add(&sum, &before, -1);
+    *row = before.rows;
+    return sum;
+}
 
-    char *line;
-    size_t linecap = 0;
-    ssize_t linelen;
+// Byte offset at which row `pos` starts in the saved file.
+long long line_index_offset(int pos)
+{
+    line_index_refresh();
+    int start;
+    int chunk = line_index_find(&edit_conf.index, pos, &start);
+    long long offset = line_index_tree_prefix(&edit_conf.index, chunk).bytes;
+    for (int j = start; j < pos; j++)
+        offset += edit_conf.rows[j].size + 1;
+    return offset;
+}
 
-    while ((linelen = getline(&line, &linecap, fp)) != -1)
+// Row containing byte `offset` of the saved file.
+int line_index_row_at(long long offset)
+{
+    line_index_refresh();
+    line_index *ix = &edit_conf.index;
+    int chunk = 0;
+    int row = 0;
+    int step = 1;
+    while (step * 2 <= ix->nchunks)
+        step *= 2;
+    for (; step > 0; step /= 2)
     {
-
-        while (linelen > 0 && (strcmp(&line[linelen - 1], "\n") == 0 || strcmp(&line[linelen - 1], "\r") == 0))
+        if (chunk + step <= ix->nchunks && ix->tree[chunk + step - 1].bytes <= offset)
         {
-            linelen--;
+            chunk += step;
+            offset -= ix->tree[chunk - 1].bytes;
+            row += ix->tree[chunk - 1].rows;
         }
-        editor_insert_row(line, linelen, edit_conf.numrows);
     }
-    free(line);
-    fclose(fp);
-}
 
-char *editor_rows_to_string(int *buflen)
-{
-    int total_len = 0;
-    for (int j = 0; j < edit_conf.numrows; j++)
+    while (row < edit_conf.numrows - 1 && offset >= edit_conf.rows[row].size + 1)
     {
-        total_len += edit_conf.rows[j].size + 1;
+        offset -= edit_conf.rows[row].size + 1;
+        row++;
     }
-    *buflen = total_len;
-    char *buf = malloc(total_len);
-    char *buf_iter = buf;
-    for (int j = 0; j < edit_conf.numrows; j++)
+    return row < edit_conf.numrows ? row : edit_conf.numrows;
+}
+
+/*** statistics ***/
+
+// Byte, word and character counts, the longest line and a histogram of line lengths are kept
+// current by the row mutators, which take a row's share out before changing it and put it back
+// after, so the status bar reads them for free. Lengths under STATS_EXACT are also counted one
+// by one so a shrinking longest line can be replaced without a rescan; longer rows are rare
+// enough to keep in a plain list. Batch workers never show them and keep them deferred.
+#define STATS_EXACT 4096
+#define STATS_PARALLEL_ROWS 65536
+
+// 0 for an empty row, otherwise one more than the position of the highest set bit.
+int stats_bucket(int size)
+{
+    int bucket = 0;
+    for (; size; size >>= 1)
+        bucket++;
+    return bucket;
+}
+
+// Words are runs of anything but ASCII whitespace; characters are UTF-8 sequences, so every byte
+// except continuation bytes. One branch-free pass counts both.
+void count_text(const char *s, int len, long long *words, long long *chars)
+{
+    int w = 0, c = 0, space = 1;
+    for (int j = 0; j < len; j++)
     {
-        memcpy(buf_iter, edit_conf.rows[j].chars, edit_conf.rows[j].size);
-        buf_iter += edit_conf.rows[j].size;
-        *buf_iter = '\n';
-        buf_iter++;
+        unsigned char b = s[j];
+        int is_space = b == ' ' || (b >= '\t' && b <= '\r');
+        w += space & !is_space;
+        space = is_space;
+        c += (b & 0xc0) != 0x80;
     }
-    return buf;
+    *words = w;
+    *chars = c;
 }
 
-void editor_save()
+int stats_find_longest(doc_stats *st)
 {
-    if (edit_conf.file_name == NULL)
-        return;
-    int len;
-    char *buf = editor_rows_to_string(&len);
-    int fd = open(edit_conf.file_name, O_RDWR | O_CREAT, 0644);
-    if (fd == -1)
+    int longest = 0;
+    for (int j = 0; j < st->nlong; j++)
+        if (st->long_rows[j] > longest)
+            longest = st->long_rows[j];
+    if (longest)
+        return longest;
+    for (int size = st->longest < STATS_EXACT ? st->longest : STATS_EXACT - 1; st->exact && size > 0; size--)
+        if (st->exact[size] > 0)
+            return size;
+    return 0;
+}
+
+void stats_count_length(doc_stats *st, int size, int sign)
+{
+    st->histogram[stats_bucket(size)] += sign;
+    if (size < STATS_EXACT)
     {
-        close(fd);
-        free(buf);
-        return;
+        if (!st->exact)
+            st->exact = calloc(STATS_EXACT, sizeof(int));
+        st->exact[size] += sign;
     }
-    if (ftruncate(fd, len) != -1)
+    else if (sign > 0)
     {
-        if (write(fd, buf, len) == len)
+        if (st->nlong == st->long_alloc)
         {
-            close(fd);
-            free(buf);
-            return;
+            st->long_alloc = st->long_alloc ? st->long_alloc * 2 : 16;
+            st->long_rows = realloc(st->long_rows, sizeof(int) * st->long_alloc);
         }
-        close(fd);
+        st->long_rows[st->nlong++] = size;
     }
-    free(buf);
+    else
+    {
+        for (int j = 0; j < st->nlong; j++)
+        {
+            if (st->long_rows[j] == size)
+            {
+                st->long_rows[j] = st->long_rows[--st->nlong];
+                break;
+            }
+        }
+    }
+
+    if (sign > 0 && size > st->longest)
+        st->longest = size;
+    else if (sign < 0 && size == st->longest)
+        st->longest = stats_find_longest(st);
 }
 
-void disable_raw_mode()
+void stats_add_rows(doc_stats *st, editrow *rows, int from, int to)
 {
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &edit_conf.original_term_mode) == -1)
+    for (int j = from; j < to; j++)
     {
-        die("tcsetattr");
+        long long words, chars;
+        count_text(rows[j].chars, rows[j].size, &words, &chars);
+        st->bytes += rows[j].size + 1;
+        st->words += words;
+        st->chars += chars + 1;
+        stats_count_length(st, rows[j].size, 1);
     }
 }
 
-void enable_raw_mode()
+// Adds (sign 1) or takes out (sign -1) one row's share of the totals.
+void stats_row(editrow *row, int sign)
 {
-    if (tcgetattr(STDIN_FILENO, &edit_conf.original_term_mode) == -1)
+    doc_stats *st = &edit_conf.stats;
+    if (st->deferred)
+        return;
+    long long words, chars;
+    count_text(row->chars, row->size, &words, &chars);
+    st->bytes += sign * (row->size + 1);
+    st->words += sign * words;
+    st->chars += sign * (chars + 1);
+    stats_count_length(st, row->size, sign);
+}
+
+void stats_reset(doc_stats *st)
+{
+    int deferred = st->deferred;
+    free(st->exact);
+    free(st->long_rows);
+    memset(st, 0, sizeof(*st));
+    st->deferred = deferred;
+}
+
+// Folds `from` into `to` and frees it.
+void stats_merge(doc_stats *to, doc_stats *from)
+{
+    to->bytes += from->bytes;
+    to->words += from->words;
+    to->chars += from->chars;
+    for (int b = 0; b < STATS_BUCKETS; b++)
+        to->histogram[b] += from->histogram[b];
+    if (from->exact && !to->exact)
+        to->exact = calloc(STATS_EXACT, sizeof(int));
+    for (int size = 0; from->exact && size < STATS_EXACT; size++)
+        to->exact[size] += from->exact[size];
+    // the histogram above already counts the long rows, so only their lengths move over
+    if (to->nlong + from->nlong > to->long_alloc)
     {
-        die("tcgetattr");
+        to->long_alloc = to->nlong + from->nlong;
+        to->long_rows = realloc(to->long_rows, sizeof(int) * to->long_alloc);
     }
-    struct termios raw = edit_conf.original_term_mode;
+    if (from->nlong)
+        memcpy(&to->long_rows[to->nlong], from->long_rows, sizeof(int) * from->nlong);
+    to->nlong += from->nlong;
+    if (from->longest > to->longest)
+        to->longest = from->longest;
+    stats_reset(from);
+}
 
-    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
-    raw.c_oflag &= ~(OPOST);
-    raw.c_iflag &= ~(IXON | ICRNL);
+typedef struct stats_job
+{
+    editrow *rows;
+    int from;
+    int to;
+    doc_stats stats;
+    pthread_t thread;
+    int started;
+} stats_job;
 
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
+void *stats_worker(void *arg)
+{
+    stats_job *job = arg;
+    stats_add_rows(&job->stats, job->rows, job->from, job->to);
+    return NULL;
+}
+
+// Counts every row from scratch, as after loading a file. Big documents are split across one
+// thread per core; the calling thread takes the first slice.
+void stats_compute()
+{
+    doc_stats *st = &edit_conf.stats;
+    stats_reset(st);
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > edit_conf.numrows / STATS_PARALLEL_ROWS)
+        threads = edit_conf.numrows / STATS_PARALLEL_ROWS;
+    if (threads < 1)
+        threads = 1;
+
+    stats_job *jobs = calloc(threads, sizeof(stats_job));
+    for (int t = 0; t < threads; t++)
     {
-        die("tcsetattr");
+        jobs[t].rows = edit_conf.rows;
+        jobs[t].from = (long long)edit_conf.numrows * t / threads;
+        jobs[t].to = (long long)edit_conf.numrows * (t + 1) / threads;
+        if (t > 0)
+            jobs[t].started = pthread_create(&jobs[t].thread, NULL, stats_worker, &jobs[t]) == 0;
     }
-
-    atexit(disable_raw_mode);
+    stats_worker(&jobs[0]);
+    for (int t = 0; t < threads; t++)
+    {
+        if (jobs[t].started)
+            pthread_join(jobs[t].thread, NULL);
+        else if (t > 0)
+            stats_worker(&jobs[t]);
+        stats_merge(st, &jobs[t].stats);
+    }
+    free(jobs);
 }
 
-int editor_read_key()
+/*** file watch ***/
+
+// The directory holding the file is watched rather than the file itself, so saves that rename
+// a new file into place keep being noticed. A hash of the last WATCH_SAMPLE bytes tells a pure
+// append apart from a rewrite without reading the whole file again.
+#define WATCH_SAMPLE 4096
+#define WATCH_EVENTS (IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE)
+
+unsigned int fnv1a(const char *s, int len, unsigned int hash)
 {
-    int read_code;
-    char character;
-    while ((read_code = read(STDIN_FILENO, &character, 1)) != 1)
+    for (int i = 0; i < len; i++)
     {
-        if (read_code == -1 && errno != EAGAIN)
-            die("read");
+        hash ^= (unsigned char)s[i];
+        hash *= 16777619u;
     }
+    return hash;
+}
 
-    if (character == '\x1b')
+// Hashes the WATCH_SAMPLE bytes preceding `size` and reports whether the last one is a newline.
+unsigned int file_tail_sample(int fd, long long size, int *newline)
+{
+    char buf[WATCH_SAMPLE];
+    long long from = size > WATCH_SAMPLE ? size - WATCH_SAMPLE : 0;
+    int len = pread(fd, buf, size - from, from);
+    if (len < 0)
+        len = 0;
+    *newline = len > 0 && buf[len - 1] == '\n';
+    return fnv1a(buf, len, 2166136261u);
+}
+
+void watch_remember(struct stat *st, unsigned int tail_hash, int tail_newline)
+{
+    file_watch *w = &edit_conf.watch;
+    w->size = st->st_size;
+    w->mtime = st->st_mtim;
+    w->ino = st->st_ino;
+    w->tail_hash = tail_hash;
+    w->tail_newline = tail_newline;
+}
+
+int watch_is_known(struct stat *st)
+{
+    file_watch *w = &edit_conf.watch;
+    return st->st_size == w->size && st->st_ino == w->ino &&
+           st->st_mtim.tv_sec == w->mtime.tv_sec && st->st_mtim.tv_nsec == w->mtime.tv_nsec;
+}
+
+void watch_open(const char *file_name)
+{
+    file_watch *w = &edit_conf.watch;
+    w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (w->fd == -1)
+        return;
+
+    const char *base = strrchr(file_name, '/');
+    char *dir = base ? strndup(file_name, base - file_name + 1) : strdup(".");
+    free(w->name);
+    w->name = strdup(base ? base + 1 : file_name);
+    if (inotify_add_watch(w->fd, dir, WATCH_EVENTS) == -1)
     {
-        char seq[3];
+        close(w->fd);
+        w->fd = -1;
+    }
+    free(dir);
+}
+
+// Changed bytes, from `from` to the end of the file, are read on a worker so that a large reload
+// never stalls input; the rows are only touched once the main loop reaps the job.
+struct reload_job
+{
+    pthread_t thread;
+    int fd;
+    struct stat st;
+    long long from;
+    char *buf;
+    unsigned int tail_hash;
+    int tail_newline;
+    int ok;
+};
+
+void *reload_worker(void *arg)
+{
+    reload_job *job = arg;
+    long long len = job->st.st_size - job->from;
+    job->buf = malloc(len + 1);
+    job->ok = pread(job->fd, job->buf, len, job->from) == len;
+    if (job->ok)
+        job->tail_hash = file_tail_sample(job->fd, job->st.st_size, &job->tail_newline);
+    return NULL;
+}
+
+void reload_free(reload_job *job)
+{
+    close(job->fd);
+    free(job->buf);
+    free(job);
+}
+
+// Waits for an outstanding read and throws it away.
+void watch_reload_cancel()
+{
+    reload_job *job = edit_conf.watch.reload;
+    if (!job)
+        return;
+    pthread_join(job->thread, NULL);
+    reload_free(job);
+    edit_conf.watch.reload = NULL;
+}
+
+// Consumes queued events and returns whether any of them concerned the open file.
+int watch_drain()
+{
+    file_watch *w = &edit_conf.watch;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int hit = 0;
+    int len;
+    while ((len = read(w->fd, buf, sizeof(buf))) > 0)
+    {
+        for (char *p = buf; p < buf + len;)
+        {
+            struct inotify_event *event = (struct inotify_event *)p;
+            if (event->len && strcmp(event->name, w->name) == 0)
+                hit = 1;
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return hit;
+}
+
+/*** line cache ***/
+
+// Files of LINE_CACHE_MIN bytes or more leave a ".<file>.rpgidx" sidecar holding the length of
+// every line as a varint, plus where the cursor was. It is keyed by size, mtime and a hash of
+// slices spread over the file, so an unchanged file is split into rows without looking for a
+// single newline, and a file that only grew has just its new tail scanned.
+#define LINE_CACHE_MAGIC "RPGIDX1\n"
+#define LINE_CACHE_MIN (1 << 20)
+#define LINE_CACHE_SLICES 64
+#define LINE_CACHE_SLICE_BYTES 64
+
+typedef struct line_cache_header
+{
+    char magic[8];
+    long long size;
+    long long mtime_sec;
+    long long mtime_nsec;
+    unsigned int sample;
+    int numrows;
+    int row;
+    int col;
+    int row_offset;
+} line_cache_header;
+
+// Hashes slices at fixed fractions of the first `size` bytes, so a file that grew still hashes
+// its old prefix to the same value.
+unsigned int line_cache_sample(int fd, long long size)
+{
+    char buf[LINE_CACHE_SLICE_BYTES];
+    unsigned int hash = fnv1a((const char *)&size, sizeof(size), 2166136261u);
+    for (int j = 0; j <= LINE_CACHE_SLICES; j++)
+    {
+        long long at = j < LINE_CACHE_SLICES ? size / LINE_CACHE_SLICES * j : size - LINE_CACHE_SLICE_BYTES;
+        if (at < 0)
+            at = 0;
+        int len = pread(fd, buf, size - at < LINE_CACHE_SLICE_BYTES ? size - at : LINE_CACHE_SLICE_BYTES, at);
+        hash = fnv1a(buf, len > 0 ? len : 0, hash);
+    }
+    return hash;
+}
+
+void line_cache_header_for(line_cache_header *header, struct stat *st, unsigned int sample)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, LINE_CACHE_MAGIC, sizeof(header->magic));
+    header->size = st->st_size;
+    header->mtime_sec = st->st_mtim.tv_sec;
+    header->mtime_nsec = st->st_mtim.tv_nsec;
+    header->sample = sample;
+    header->numrows = edit_conf.numrows;
+    header->row = edit_conf.cy + edit_conf.row_offset;
+    header->col = edit_conf.cx;
+    header->row_offset = edit_conf.row_offset;
+}
+
+void line_cache_put(unsigned char **body, int *len, int *alloc, unsigned int span)
+{
+    if (*len + 5 > *alloc)
+    {
+        *alloc = *alloc ? *alloc * 2 : 4096;
+        *body = realloc(*body, *alloc);
+    }
+    *len += varint_put(&(*body)[*len], span);
+}
+
+// The line lengths must add up to the size they claim to cover.
+int line_cache_check(const unsigned char *body, int len, line_cache_header *header)
+{
+    long long total = 0;
+    int rows = 0;
+    for (int pos = 0; pos < len; rows++)
+    {
+        unsigned int span;
+        pos += varint_get(&body[pos], &span);
+        if (pos > len || span == 0)
+            return 0;
+        total += span;
+    }
+    return total == header->size && rows == header->numrows;
+}
+
+// Returns the sidecar's line lengths if they still describe the file, or a prefix of it.
+unsigned char *line_cache_read(const char *file_name, int fd, struct stat *st, line_cache_header *header, int *len)
+{
+    char *path = sidecar_path(file_name, "rpgidx");
+    int cache_fd = open(path, O_RDONLY);
+    free(path);
+    if (cache_fd == -1)
+        return NULL;
+
+    struct stat cache_st;
+    unsigned char *body = NULL;
+    if (fstat(cache_fd, &cache_st) == 0 && cache_st.st_size >= (off_t)sizeof(*header) &&
+        pread(cache_fd, header, sizeof(*header), 0) == sizeof(*header) &&
+        memcmp(header->magic, LINE_CACHE_MAGIC, sizeof(header->magic)) == 0 &&
+        (header->size < st->st_size ||
+         (header->size == st->st_size && header->mtime_sec == st->st_mtim.tv_sec && header->mtime_nsec == st->st_mtim.tv_nsec)) &&
+        line_cache_sample(fd, header->size) == header->sample)
+    {
+        *len = cache_st.st_size - sizeof(*header);
+        // zero padding stops a varint cut short by a torn write from reading past the end
+        body = calloc(*len + 5, 1);
+        if (pread(cache_fd, body, *len, sizeof(*header)) != *len || !line_cache_check(body, *len, header))
+        {
+            free(body);
+            body = NULL;
+        }
+    }
+    close(cache_fd);
+    return body;
+}
+
+void line_cache_write(const char *file_name, line_cache_header *header, const unsigned char *body, int len)
+{
+    char *path = sidecar_path(file_name, "rpgidx");
+    int tmp_len = strlen(path) + 5;
+    char *tmp = malloc(tmp_len);
+    snprintf(tmp, tmp_len, "%s.tmp", path);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd != -1)
+    {
+        int ok = write(fd, header, sizeof(*header)) == sizeof(*header) && write(fd, body, len) == len;
+        close(fd);
+        if (!ok || rename(tmp, path) == -1)
+            unlink(tmp);
+    }
+    free(tmp);
+    free(path);
+}
+
+// Rebuilds the sidecar from the rows, which must be exactly what `fd` holds, as after a save.
+void line_cache_store(int fd, struct stat *st)
+{
+    if (!edit_conf.line_cache || st->st_size < LINE_CACHE_MIN)
+        return;
+
+    unsigned char *body = NULL;
+    int len = 0, alloc = 0;
+    long long total = 0;
+    for (int j = 0; j < edit_conf.numrows; j++)
+    {
+        line_cache_put(&body, &len, &alloc, edit_conf.rows[j].size + 1);
+        total += edit_conf.rows[j].size + 1;
+    }
+    if (total == st->st_size)
+    {
+        line_cache_header header;
+        line_cache_header_for(&header, st, line_cache_sample(fd, st->st_size));
+        line_cache_write(edit_conf.file_name, &header, body, len);
+    }
+    free(body);
+}
+
+// Called as a document closes: the cursor goes into a sidecar that still matches the file, and
+// one made stale by an autosave is rebuilt as long as the rows are still what was written.
+void line_cache_close()
+{
+    if (!edit_conf.line_cache || !edit_conf.file_name)
+        return;
+
+    char *path = sidecar_path(edit_conf.file_name, "rpgidx");
+    int cache_fd = open(path, O_RDWR);
+    free(path);
+    line_cache_header header;
+    file_watch *w = &edit_conf.watch;
+    if (cache_fd != -1 && pread(cache_fd, &header, sizeof(header), 0) == sizeof(header) &&
+        memcmp(header.magic, LINE_CACHE_MAGIC, sizeof(header.magic)) == 0 && header.size == w->size &&
+        header.mtime_sec == w->mtime.tv_sec && header.mtime_nsec == w->mtime.tv_nsec)
+    {
+        header.row = edit_conf.cy + edit_conf.row_offset;
+        header.col = edit_conf.cx;
+        header.row_offset = edit_conf.row_offset;
+        pwrite(cache_fd, &header, sizeof(header), 0);
+    }
+    else if (edit_conf.edits == edit_conf.saved_edits)
+    {
+        struct stat st;
+        int fd = open(edit_conf.file_name, O_RDONLY);
+        if (fd != -1 && fstat(fd, &st) == 0 && watch_is_known(&st))
+            line_cache_store(fd, &st);
+        if (fd != -1)
+            close(fd);
+    }
+    if (cache_fd != -1)
+        close(cache_fd);
+}
+
+/*** plugins ***/
+
+// Hooks live in one dense array per hook and are called through PLUGIN_HOOK, so a hook nobody
+// registered costs a single compare at its call site. Unequipping the DLC item empties the arrays.
+#define PLUGIN_MAX 16
+
+typedef struct plugin_table
+{
+    const rpg_plugin *loaded[PLUGIN_MAX];
+    int nloaded;
+
+    rpg_row_changed_hook row_changed[PLUGIN_MAX];
+    rpg_render_row_hook render_row[PLUGIN_MAX];
+    rpg_keypress_hook keypress[PLUGIN_MAX];
+    rpg_saved_hook saved[PLUGIN_MAX];
+    int n_row_changed;
+    int n_render_row;
+    int n_keypress;
+    int n_saved;
+} plugin_table;
+plugin_table plugins;
+
+#define PLUGIN_HOOK(hook, ...)                                    \
+    for (int hook_i = 0; hook_i < plugins.n_##hook; hook_i++) \
+    plugins.hook[hook_i](__VA_ARGS__)
+
+int plugin_host_numrows(void)
+{
+    return edit_conf.numrows;
+}
+
+const char *plugin_host_row(int index, int *size)
+{
+    if (index < 0 || index >= edit_conf.numrows)
+        return NULL;
+    *size = edit_conf.rows[index].size;
+    return edit_conf.rows[index].chars;
+}
+
+// Defined with the rest of the screen code; plugins report through the very same status line.
+void editor_set_status(const char *fmt, ...);
+
+const rpg_host plugin_host = {RPG_PLUGIN_ABI, plugin_host_numrows, plugin_host_row, editor_set_status};
+
+void plugins_enable(int on)
+{
+    plugins.n_row_changed = plugins.n_render_row = plugins.n_keypress = plugins.n_saved = 0;
+    for (int j = 0; on && j < plugins.nloaded; j++)
+    {
+        const rpg_plugin *plugin = plugins.loaded[j];
+        if (plugin->row_changed)
+            plugins.row_changed[plugins.n_row_changed++] = plugin->row_changed;
+        if (plugin->render_row)
+            plugins.render_row[plugins.n_render_row++] = plugin->render_row;
+        if (plugin->keypress)
+            plugins.keypress[plugins.n_keypress++] = plugin->keypress;
+        if (plugin->saved)
+            plugins.saved[plugins.n_saved++] = plugin->saved;
+    }
+}
+
+int plugin_register(const rpg_plugin *plugin)
+{
+    if (!plugin || plugin->abi != RPG_PLUGIN_ABI || plugins.nloaded == PLUGIN_MAX)
+        return -1;
+    plugins.loaded[plugins.nloaded++] = plugin;
+    return 0;
+}
+
+int plugin_load(const char *path)
+{
+    void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle)
+    {
+        editor_set_status("DLC failed: %s", dlerror());
+        return -1;
+    }
+    rpg_plugin_init_fn init;
+    *(void **)&init = dlsym(handle, "rpg_plugin_init");
+    if (!init || plugin_register(init(&plugin_host)) == -1)
+    {
+        editor_set_status("DLC rejected: %s", path);
+        dlclose(handle);
+        return -1;
+    }
+    return 0;
+}
+
+// Loads every plugin named in RPGEDITOR_PLUGINS and returns how many are installed.
+int plugins_load_env()
+{
+    char *list = getenv("RPGEDITOR_PLUGINS");
+    if (!list)
+        return 0;
+    char *paths = strdup(list);
+    char *save;
+    for (char *path = strtok_r(paths, ":", &save); path; path = strtok_r(NULL, ":", &save))
+        plugin_load(path);
+    free(paths);
+    return plugins.nloaded;
+}
+
+/*** line pool ***/
+
+// Rows read from disk point into a pool of interned, reference-counted payloads, so a line that
+// appears in several open buffers (or several times in one) is stored once. Interned payloads are
+// never written to: editor_row_unshare gives a row its own copy before the first edit. The pool
+// is per thread, like edit_conf; batch workers hold one document at a time and switch it off.
+typedef struct pool_entry
+{
+    struct pool_entry *next;
+    unsigned int hash;
+    int refs;
+    int len;
+    char chars[];
+} pool_entry;
+
+typedef struct line_pool
+{
+    pool_entry **buckets;
+    int nbuckets;
+    int entries;
+    long long refs;
+    long long bytes;
+    long long saved;
+    int off;
+} line_pool;
+__thread line_pool pool;
+
+pool_entry *pool_entry_of(char *chars)
+{
+    return (pool_entry *)(chars - offsetof(pool_entry, chars));
+}
+
+// Makes room for `entries` lines at one per bucket, rehashing at most once.
+void pool_reserve(int entries)
+{
+    if (entries <= pool.nbuckets)
+        return;
+    int nbuckets = pool.nbuckets ? pool.nbuckets : 1024;
+    while (nbuckets < entries)
+        nbuckets *= 2;
+    pool_entry **buckets = calloc(nbuckets, sizeof(pool_entry *));
+    for (int b = 0; b < pool.nbuckets; b++)
+    {
+        pool_entry *next;
+        for (pool_entry *e = pool.buckets[b]; e; e = next)
+        {
+            next = e->next;
+            e->next = buckets[e->hash & (nbuckets - 1)];
+            buckets[e->hash & (nbuckets - 1)] = e;
+        }
+    }
+    free(pool.buckets);
+    pool.buckets = buckets;
+    pool.nbuckets = nbuckets;
+}
+
+char *pool_intern(const char *s, int len)
+{
+    if (pool.entries >= pool.nbuckets)
+        pool_reserve(pool.entries + 1);
+    unsigned int hash = fnv1a(s, len, 2166136261u);
+    pool_entry **bucket = &pool.buckets[hash & (pool.nbuckets - 1)];
+    pool.refs++;
+    for (pool_entry *e = *bucket; e; e = e->next)
+    {
+        if (e->hash == hash && e->len == len && memcmp(e->chars, s, len) == 0)
+        {
+            e->refs++;
+            pool.saved += len + 1;
+            return e->chars;
+        }
+    }
+
+    pool_entry *e = malloc(sizeof(pool_entry) + len + 1);
+    e->hash = hash;
+    e->refs = 1;
+    e->len = len;
+    memcpy(e->chars, s, len);
+    e->chars[len] = '\0';
+    e->next = *bucket;
+    *bucket = e;
+    pool.entries++;
+    pool.bytes += len + 1;
+    return e->chars;
+}
+
+void pool_release(char *chars)
+{
+    pool_entry *e = pool_entry_of(chars);
+    pool.refs--;
+    if (--e->refs > 0)
+    {
+        pool.saved -= e->len + 1;
+        return;
+    }
+    pool_entry **link = &pool.buckets[e->hash & (pool.nbuckets - 1)];
+    while (*link != e)
+        link = &(*link)->next;
+    *link = e->next;
+    pool.entries--;
+    pool.bytes -= e->len + 1;
+    free(e);
+}
+
+/*** autosave ***/
+
+// An autosave snapshot copies only the rows index; the payloads stay shared with the live
+// document. Rows whose gen predates snapshot_gen may still be read by the worker, so they are
+// copied before being modified and their old payload, malloc'd or interned, is kept alive until
+// the job is reaped.
+#define AUTOSAVE_IDLE_MS 2000
+#define AUTOSAVE_INTERVAL_MS 30000
+#define AUTOSAVE_BUFFER (1024 * 1024)
+
+struct autosave_job
+{
+    pthread_t thread;
+    editrow *rows;
+    int numrows;
+    char *file_name;
+    int crlf;
+    int no_final_newline;
+
+    editrow *orphans;
+    int norphans;
+    int orphans_alloc;
+
+    long long edits;
+    long long swap_at;
+    int swap_row;
+    long long started_ms;
+
+    int ok;
+    int err;
+    struct stat st;
+    unsigned int tail_hash;
+    int tail_newline;
+};
+
+void editor_row_drop(editrow *row)
+{
+    if (row->interned)
+        pool_release(row->chars);
+    else
+        free(row->chars);
+}
+
+void editor_row_free(editrow *row)
+{
+    autosave_job *job = edit_conf.autosave;
+    if (!job || row->gen == edit_conf.snapshot_gen)
+    {
+        editor_row_drop(row);
+        return;
+    }
+    if (job->norphans == job->orphans_alloc)
+    {
+        job->orphans_alloc = job->orphans_alloc ? job->orphans_alloc * 2 : 64;
+        job->orphans = realloc(job->orphans, sizeof(editrow) * job->orphans_alloc);
+    }
+    job->orphans[job->norphans++] = *row;
+}
+
+void editor_row_unshare(editrow *row)
+{
+    if (!row->interned && (!edit_conf.autosave || row->gen == edit_conf.snapshot_gen))
+        return;
+    char *chars = malloc(row->size + 1);
+    memcpy(chars, row->chars, row->size);
+    chars[row->size] = '\0';
+    editor_row_free(row);
+    row->chars = chars;
+    row->gen = edit_conf.snapshot_gen;
+    row->interned = 0;
+}
+
+// Writes through symlinks to the real file. A file with other hard links, or one whose owner
+// cannot be carried over to a fresh inode, is rewritten in place instead of renamed over.
+void *autosave_worker(void *arg)
+{
+    autosave_job *job = arg;
+    char *path = realpath(job->file_name, NULL);
+    if (!path)
+        path = strdup(job->file_name);
+    const char *base = strrchr(path, '/');
+    int dir_len = base ? base - path + 1 : 0;
+    base = base ? base + 1 : path;
+
+    int tmp_len = dir_len + strlen(base) + 9;
+    char *tmp = malloc(tmp_len);
+    snprintf(tmp, tmp_len, "%.*s.%s.rpgtmp", dir_len, path, base);
+
+    struct stat st;
+    int exists = stat(path, &st) == 0;
+    int in_place = exists && st.st_nlink > 1;
+    int fd = -1;
+    if (!in_place)
+    {
+        fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, exists ? st.st_mode & 07777 : 0644);
+        if (fd != -1 && exists && (st.st_uid != geteuid() || st.st_gid != getegid()) &&
+            fchown(fd, st.st_uid, st.st_gid) != 0)
+        {
+            close(fd);
+            unlink(tmp);
+            in_place = 1;
+        }
+    }
+    if (in_place)
+        fd = open(path, O_RDWR | O_TRUNC);
+    if (fd == -1)
+    {
+        job->err = errno;
+        free(tmp);
+        free(path);
+        return NULL;
+    }
+
+    char *buf = malloc(AUTOSAVE_BUFFER);
+    int used = 0;
+    int ok = 1;
+    const char *eol = job->crlf ? "\r\n" : "\n";
+    // a short write leaves errno alone
+    errno = 0;
+    for (int j = 0; j < job->numrows && ok; j++)
+    {
+        editrow *row = &job->rows[j];
+        int eol_len = j == job->numrows - 1 && job->no_final_newline ? 0 : 1 + job->crlf;
+        if (used + row->size + eol_len > AUTOSAVE_BUFFER)
+        {
+            ok = write(fd, buf, used) == used;
+            used = 0;
+        }
+        if (row->size + eol_len > AUTOSAVE_BUFFER)
+        {
+            ok = ok && write(fd, row->chars, row->size) == row->size && write(fd, eol, eol_len) == eol_len;
+            continue;
+        }
+        memcpy(&buf[used], row->chars, row->size);
+        used += row->size;
+        memcpy(&buf[used], eol, eol_len);
+        used += eol_len;
+    }
+    ok = ok && write(fd, buf, used) == used;
+    free(buf);
+
+    ok = ok && fdatasync(fd) == 0 && fstat(fd, &job->st) == 0;
+    if (ok)
+        job->tail_hash = file_tail_sample(fd, job->st.st_size, &job->tail_newline);
+    else
+        job->err = errno ? errno : EIO;
+    close(fd);
+    if (!in_place)
+    {
+        if (ok && rename(tmp, path) != 0)
+        {
+            job->err = errno;
+            ok = 0;
+        }
+        if (!ok)
+            unlink(tmp);
+    }
+    free(tmp);
+    free(path);
+    job->ok = ok;
+    return NULL;
+}
+
+int autosave_start()
+{
+    if (edit_conf.autosave || edit_conf.file_name == NULL)
+        return 0;
+
+    autosave_job *job = calloc(1, sizeof(autosave_job));
+    job->rows = malloc(sizeof(editrow) * (edit_conf.numrows + 1));
+    memcpy(job->rows, edit_conf.rows, sizeof(editrow) * edit_conf.numrows);
+    job->numrows = edit_conf.numrows;
+    job->file_name = strdup(edit_conf.file_name);
+    job->crlf = edit_conf.crlf;
+    job->no_final_newline = edit_conf.no_final_newline;
+    job->edits = edit_conf.edits;
+    job->swap_at = swap_mark(&job->swap_row);
+    job->started_ms = monotonic_ms();
+    edit_conf.autosave_started_ms = job->started_ms;
+
+    if (pthread_create(&job->thread, NULL, autosave_worker, job) != 0)
+    {
+        free(job->rows);
+        free(job->file_name);
+        free(job);
+        return 0;
+    }
+    edit_conf.snapshot_gen++;
+    edit_conf.autosave = job;
+    edit_conf.save_requested = 0;
+    edit_conf.watch.conflict = 0;
+    return 1;
+}
+
+// Rows stop counting as modified once a save that contains every edit so far has landed.
+void editor_mark_saved(long long edits)
+{
+    edit_conf.saved_edits = edits;
+    PLUGIN_HOOK(saved, edit_conf.file_name);
+    if (edits == edit_conf.edits)
+        line_index_clear_modified();
+}
+
+int autosave_finish(int wait)
+{
+    autosave_job *job = edit_conf.autosave;
+    if (!job)
+        return 0;
+    if (wait)
+        pthread_join(job->thread, NULL);
+    else if (pthread_tryjoin_np(job->thread, NULL) != 0)
+        return 0;
+
+    for (int i = 0; i < job->norphans; i++)
+        editor_row_drop(&job->orphans[i]);
+    if (!job->ok)
+    {
+        // retried on the next edit or explicit save rather than on every tick
+        edit_conf.save_errno = job->err;
+        edit_conf.failed_edits = job->edits;
+        editor_set_status("Autosave failed: %s", strerror(job->err));
+    }
+    else
+    {
+        edit_conf.save_errno = 0;
+        editor_mark_saved(job->edits);
+        edit_conf.autosaved_at = time(NULL);
+        edit_conf.autosave_took_ms = monotonic_ms() - job->started_ms;
+        swap_rebase(&job->st, job->swap_at, job->swap_row);
+        watch_remember(&job->st, job->tail_hash, job->tail_newline);
+    }
+    free(job->orphans);
+    free(job->rows);
+    free(job->file_name);
+    free(job);
+    edit_conf.autosave = NULL;
+    return 1;
+}
+
+/*** buffers ***/
+
+// The active buffer always lives in edit_conf and the rest are parked as whole editorConfig
+// copies, so switching is one struct copy and a redraw. Every piece of per-document state that a
+// thread can see (journal, swap writer, autosave job) sits behind a pointer and survives the copy.
+typedef struct buffer_list
+{
+    struct editorConfig *parked;
+    int count;
+    int current;
+} buffer_list;
+buffer_list buffers = {NULL, 1, 0};
+
+// Terminal state belongs to the terminal, not to whichever document happens to be active.
+void buffer_activate(int index)
+{
+    struct editorConfig *next = &buffers.parked[index];
+    next->original_term_mode = edit_conf.original_term_mode;
+    next->screen_rows = edit_conf.screen_rows;
+    next->screen_cols = edit_conf.screen_cols;
+    edit_conf = *next;
+    buffers.current = index;
+}
+
+void buffer_switch(int index)
+{
+    if (index == buffers.current || index < 0 || index >= buffers.count)
+        return;
+    buffers.parked[buffers.current] = edit_conf;
+    buffer_activate(index);
+}
+
+void editor_init_document()
+{
+    struct editorConfig blank = {0};
+    blank.original_term_mode = edit_conf.original_term_mode;
+    blank.screen_rows = edit_conf.screen_rows;
+    blank.screen_cols = edit_conf.screen_cols;
+    edit_conf = blank;
+    journal_init(&edit_conf.journal);
+    edit_conf.autosave_started_ms = monotonic_ms();
+    edit_conf.watch.fd = -1;
+}
+
+// Parks the active buffer and makes a fresh, empty one active.
+void buffer_new()
+{
+    buffers.parked = realloc(buffers.parked, sizeof(struct editorConfig) * (buffers.count + 1));
+    buffers.parked[buffers.current] = edit_conf;
+    buffers.current = buffers.count++;
+    editor_init_document();
+}
+
+// Frees everything the active document owns and discards its swap; a document whose edits must
+// survive goes through editor_flush first.
+void buffer_release()
+{
+    watch_reload_cancel();
+    autosave_finish(1);
+    swap_close(1);
+    line_cache_close();
+    if (edit_conf.watch.fd != -1)
+        close(edit_conf.watch.fd);
+    free(edit_conf.watch.name);
+    for (int j = 0; j < edit_conf.numrows; j++)
+        editor_row_free(&edit_conf.rows[j]);
+    free(edit_conf.rows);
+    free(edit_conf.file_name);
+    free(edit_conf.journal.data);
+    free(edit_conf.index.chunks);
+    free(edit_conf.index.tree);
+    free(edit_conf.search);
+    stats_reset(&edit_conf.stats);
+}
+
+// Drops the active buffer for the next one; closing the last buffer is quitting.
+void buffer_close()
+{
+    if (buffers.count == 1)
+        return;
+    buffer_release();
+    int closing = buffers.current;
+    memmove(&buffers.parked[closing], &buffers.parked[closing + 1],
+            sizeof(struct editorConfig) * (buffers.count - closing - 1));
+    buffers.count--;
+    buffer_activate(closing < buffers.count ? closing : buffers.count - 1);
+}
+
+/*** functions ***/
+
+int editor_text_cols()
+{
+    if (inventory.map == 2 && edit_conf.screen_cols > 2 * (MINIMAP_WIDTH + 1))
+        return edit_conf.screen_cols - MINIMAP_WIDTH - 1;
+    return edit_conf.screen_cols;
+}
+
+void editor_insert_row(char *s, size_t len, int pos)
+{
+    if (pos < 0 || pos > edit_conf.numrows)
+        return;
+    editor_log_edit(JOURNAL_INSERT_ROW, pos, 0, s, len);
+    edit_conf.rows = realloc(edit_conf.rows, sizeof(editrow) * (edit_conf.numrows + 1));
+    memmove(&edit_conf.rows[pos + 1], &edit_conf.rows[pos], sizeof(editrow) * (edit_conf.numrows - pos));
+
+    editrow *row = &edit_conf.rows[pos];
+    row->size = len;
+    row->gen = edit_conf.snapshot_gen;
+    row->modified = !edit_conf.loading;
+    row->interned = edit_conf.loading > 0 && !pool.off;
+    if (row->interned)
+    {
+        row->chars = pool_intern(s, len);
+    }
+    else
+    {
+        row->chars = malloc(len + 1);
+        memcpy(row->chars, s, len);
+        row->chars[len] = '\0';
+    }
+    edit_conf.numrows++;
+    stats_row(row, 1);
+    line_index_inserted(pos, 1);
+    PLUGIN_HOOK(row_changed, pos, 0, 1);
+}
+
+void editor_split_row(int pos, int at)
+{
+    if (at == 0 || pos >= edit_conf.numrows)
+    {
+        editor_insert_row("", 0, pos);
+        return;
+    }
+    editor_log_edit(JOURNAL_SPLIT_ROW, pos, at, "", 0);
+    edit_conf.log_mute++;
+
+    editrow *row = &edit_conf.rows[pos];
+    editor_insert_row(&row->chars[at], row->size - at, pos + 1);
+    row = &edit_conf.rows[pos];
+    line_summary before = row_summary(row);
+    stats_row(row, -1);
+    editor_row_unshare(row);
+    row->size = at;
+    row->chars[row->size] = '\0';
+    row->modified = !edit_conf.loading;
+    stats_row(row, 1);
+    line_index_update(pos, &before);
+    PLUGIN_HOOK(row_changed, pos, 1, 1);
+
+    edit_conf.log_mute--;
+}
+
+void editor_insert_newline()
+{
+    editor_split_row(edit_conf.cy + edit_conf.row_offset, edit_conf.cx);
+    edit_conf.cy++;
+    edit_conf.cx = 0;
+}
+
+void editor_row_insert_char(editrow *row, int position, int chr)
+{
+    if (position < 0 || position > row->size)
+        position = row->size;
+    char c = chr;
+    editor_log_edit(JOURNAL_INSERT_CHARS, row - edit_conf.rows, position, &c, 1);
+    line_summary before = row_summary(row);
+    stats_row(row, -1);
+    editor_row_unshare(row);
+    row->chars = realloc(row->chars, row->size + 2);
+    memmove(&row->chars[position + 1], &row->chars[position], row->size - position + 1);
+    row->size++;
+    row->chars[position] = chr;
+    row->modified = !edit_conf.loading;
+    stats_row(row, 1);
+    line_index_update(row - edit_conf.rows, &before);
+    PLUGIN_HOOK(row_changed, row - edit_conf.rows, 1, 1);
+}
+
+void editor_row_insert_string(editrow *row, int position, const char *s, int len)
+{
+    if (position < 0 || position > row->size)
+        position = row->size;
+    editor_log_edit(JOURNAL_INSERT_CHARS, row - edit_conf.rows, position, s, len);
+    line_summary before = row_summary(row);
+    stats_row(row, -1);
+    editor_row_unshare(row);
+    row->chars = realloc(row->chars, row->size + len + 1);
+    memmove(&row->chars[position + len], &row->chars[position], row->size - position + 1);
+    memcpy(&row->chars[position], s, len);
+    row->size += len;
+    row->modified = !edit_conf.loading;
+    stats_row(row, 1);
+    line_index_update(row - edit_conf.rows, &before);
+    PLUGIN_HOOK(row_changed, row - edit_conf.rows, 1, 1);
+}
+
+void editor_insert_char(int chr)
+{
+    journal_group_begin();
+    if (edit_conf.cy + edit_conf.row_offset == edit_conf.numrows)
+    {
+        editor_insert_row("", 0, edit_conf.numrows);
+    }
+    editor_row_insert_char(&edit_conf.rows[edit_conf.cy + edit_conf.row_offset], edit_conf.cx, chr);
+    journal_group_end();
+    edit_conf.cx++;
+}
+
+void editor_row_del_chars(editrow *row, int position, int len)
+{
+    if (position < 0 || position >= row->size || len <= 0)
+        return;
+    if (len > row->size - position)
+        len = row->size - position;
+    editor_log_edit(JOURNAL_DEL_CHARS, row - edit_conf.rows, position, &row->chars[position], len);
+    line_summary before = row_summary(row);
+    stats_row(row, -1);
+    editor_row_unshare(row);
+    memmove(&row->chars[position], &row->chars[position + len], row->size - position - len + 1);
+    row->size -= len;
+    row->modified = !edit_conf.loading;
+    stats_row(row, 1);
+    line_index_update(row - edit_conf.rows, &before);
+    PLUGIN_HOOK(row_changed, row - edit_conf.rows, 1, 1);
+}
+
+void editor_row_del_char(editrow *row, int position)
+{
+    editor_row_del_chars(row, position, 1);
+}
+
+void editor_row_append_string(editrow *row, char *s, size_t len)
+{
+    editor_log_edit(JOURNAL_APPEND, row - edit_conf.rows, row->size, s, len);
+    line_summary before = row_summary(row);
+    stats_row(row, -1);
+    editor_row_unshare(row);
+    row->chars = realloc(row->chars, row->size + len + 1);
+    memcpy(&row->chars[row->size], s, len);
+    row->size += len;
+    row->chars[row->size] = '\0';
+    row->modified = !edit_conf.loading;
+    stats_row(row, 1);
+    line_index_update(row - edit_conf.rows, &before);
+    PLUGIN_HOOK(row_changed, row - edit_conf.rows, 1, 1);
+}
+
+void editor_del_row(int position)
+{
+    if (position < 0 || position >= edit_conf.numrows)
+        return;
+    editrow *row = &edit_conf.rows[position];
+    editor_log_edit(JOURNAL_DEL_ROW, position, 0, row->chars, row->size);
+    line_summary removed = row_summary(row);
+    stats_row(row, -1);
+    editor_row_free(row);
+    memmove(&edit_conf.rows[position], &edit_conf.rows[position + 1], sizeof(editrow) * (edit_conf.numrows - position - 1));
+    edit_conf.numrows--;
+    line_index_deleted(position, &removed);
+    PLUGIN_HOOK(row_changed, position, 1, 0);
+}
+
+// Replaces `del` rows at `pos` with `ins` new ones, moving the tail of the rows array only once.
+// Callers are responsible for logging the change.
+void editor_splice_rows(int pos, int del, char **lines, int *lens, int ins)
+{
+    if (pos < 0 || pos > edit_conf.numrows)
+        return;
+    if (del > edit_conf.numrows - pos)
+        del = edit_conf.numrows - pos;
+
+    line_index_removing(pos, del);
+    for (int j = pos; j < pos + del; j++)
+    {
+        stats_row(&edit_conf.rows[j], -1);
+        editor_row_free(&edit_conf.rows[j]);
+    }
+    if (ins > del)
+        edit_conf.rows = realloc(edit_conf.rows, sizeof(editrow) * (edit_conf.numrows - del + ins));
+    memmove(&edit_conf.rows[pos + ins], &edit_conf.rows[pos + del], sizeof(editrow) * (edit_conf.numrows - pos - del));
+
+    for (int j = 0; j < ins; j++)
+    {
+        editrow *row = &edit_conf.rows[pos + j];
+        row->size = lens[j];
+        row->gen = edit_conf.snapshot_gen;
+        row->modified = !edit_conf.loading;
+        row->interned = edit_conf.loading > 0 && !pool.off;
+        if (row->interned)
+        {
+            row->chars = pool_intern(lines[j], lens[j]);
+        }
+        else
+        {
+            row->chars = malloc(lens[j] + 1);
+            memcpy(row->chars, lines[j], lens[j]);
+            row->chars[lens[j]] = '\0';
+        }
+        stats_row(row, 1);
+    }
+    edit_conf.numrows += ins - del;
+    line_index_inserted(pos, ins);
+    PLUGIN_HOOK(row_changed, pos, del, ins);
+}
+
+// Block text is the span's lines joined with '\n'; this finds where text put at (row, col) ends.
+void block_end(int row, int col, const char *text, int len, int *end_row, int *end_col)
+{
+    *end_row = row;
+    *end_col = col + len;
+    for (int j = 0; j < len; j++)
+    {
+        if (text[j] == '\n')
+        {
+            (*end_row)++;
+            *end_col = len - j - 1;
+        }
+    }
+}
+
+char *editor_block_text(int r0, int c0, int r1, int c1, int *len_out)
+{
+    int len = 0;
+    for (int j = r0; j <= r1; j++)
+        len += (j == r1 ? c1 : edit_conf.rows[j].size) - (j == r0 ? c0 : 0) + (j < r1);
+    char *text = malloc(len + 1);
+    char *p = text;
+    for (int j = r0; j <= r1; j++)
+    {
+        int from = j == r0 ? c0 : 0;
+        int to = j == r1 ? c1 : edit_conf.rows[j].size;
+        memcpy(p, &edit_conf.rows[j].chars[from], to - from);
+        p += to - from;
+        if (j < r1)
+            *p++ = '\n';
+    }
+    *p = '\0';
+    *len_out = len;
+    return text;
+}
+
+// Removes everything from (r0, c0) up to (r1, c1). The whole rows in between leave the rows
+// array through a single splice, so the cost does not depend on how many rows follow the span.
+void editor_del_block(int r0, int c0, int r1, int c1)
+{
+    if (r0 < 0 || r0 >= edit_conf.numrows || r1 < r0)
+        return;
+    if (r1 >= edit_conf.numrows)
+    {
+        r1 = edit_conf.numrows - 1;
+        c1 = edit_conf.rows[r1].size;
+    }
+    if (c0 > edit_conf.rows[r0].size)
+        c0 = edit_conf.rows[r0].size;
+    if (c1 > edit_conf.rows[r1].size)
+        c1 = edit_conf.rows[r1].size;
+    if (r0 == r1 && c0 >= c1)
+        return;
+
+    if (!edit_conf.log_mute)
+    {
+        int len;
+        char *text = editor_block_text(r0, c0, r1, c1, &len);
+        editor_log_edit(JOURNAL_DEL_BLOCK, r0, c0, text, len);
+        free(text);
+    }
+    edit_conf.log_mute++;
+
+    editrow *first = &edit_conf.rows[r0];
+    if (r0 == r1)
+    {
+        editor_row_del_chars(first, c0, c1 - c0);
+    }
+    else
+    {
+        editrow *last = &edit_conf.rows[r1];
+        editor_row_del_chars(first, c0, first->size - c0);
+        editor_row_append_string(first, &last->chars[c1], last->size - c1);
+        editor_splice_rows(r0 + 1, r1 - r0, NULL, NULL, 0);
+    }
+
+    edit_conf.log_mute--;
+}
+
+// Inserts block text at (row, col); every line after the first becomes a new row in one splice.
+void editor_put_block(int row, int col, const char *text, int len)
+{
+    if (row < 0 || row > edit_conf.numrows || len <= 0)
+        return;
+    journal_group_begin();
+    if (row == edit_conf.numrows)
+        editor_insert_row("", 0, row);
+    editrow *target = &edit_conf.rows[row];
+    if (col > target->size)
+        col = target->size;
+
+    editor_log_edit(JOURNAL_PUT_BLOCK, row, col, text, len);
+    journal_group_end();
+    edit_conf.log_mute++;
+
+    const char *newline = memchr(text, '\n', len);
+    if (!newline)
+    {
+        editor_row_insert_string(target, col, text, len);
+    }
+    else
+    {
+        int lines = 0;
+        for (const char *p = newline; p; p = memchr(p + 1, '\n', &text[len] - p - 1))
+            lines++;
+        char **starts = malloc(sizeof(char *) * lines);
+        int *lens = malloc(sizeof(int) * lines);
+
+        // the last new row carries the text that followed the insertion point
+        int tail_len = target->size - col;
+        const char *start = newline + 1;
+        for (int j = 0; j < lines; j++)
+        {
+            const char *end = j < lines - 1 ? memchr(start, '\n', &text[len] - start) : &text[len];
+            starts[j] = (char *)start;
+            lens[j] = end - start;
+            start = end + 1;
+        }
+        char *last = malloc(lens[lines - 1] + tail_len);
+        memcpy(last, starts[lines - 1], lens[lines - 1]);
+        memcpy(&last[lens[lines - 1]], &target->chars[col], tail_len);
+        starts[lines - 1] = last;
+        lens[lines - 1] += tail_len;
+
+        editor_row_del_chars(target, col, tail_len);
+        editor_row_insert_string(target, col, text, newline - text);
+        editor_splice_rows(row + 1, 0, starts, lens, lines);
+
+        free(last);
+        free(starts);
+        free(lens);
+    }
+
+    edit_conf.log_mute--;
+}
+
+void editor_join_row(int pos)
+{
+    if (pos < 0 || pos + 1 >= edit_conf.numrows)
+        return;
+    editor_log_edit(JOURNAL_JOIN_ROW, pos, edit_conf.rows[pos].size, "", 0);
+    edit_conf.log_mute++;
+
+    editrow *next = &edit_conf.rows[pos + 1];
+    editor_row_append_string(&edit_conf.rows[pos], next->chars, next->size);
+    editor_del_row(pos + 1);
+
+    edit_conf.log_mute--;
+}
+
+void editor_del_char()
+{
+    if (edit_conf.cy == edit_conf.numrows)
+        return;
+    if (edit_conf.cx == 0 && edit_conf.cy == 0)
+        return;
+
+    editrow *row = &edit_conf.rows[edit_conf.cy];
+    if (edit_conf.cx > 0)
+    {
+        editor_row_del_char(row, edit_conf.cx - 1);
+        edit_conf.cx--;
+    }
+    else
+    {
+        int new_x = edit_conf.rows[edit_conf.cy - 1].size;
+        if (new_x > editor_text_cols() - 1)
+            new_x = editor_text_cols() - 1;
+        edit_conf.cx = new_x;
+        editor_join_row(edit_conf.cy - 1);
+        edit_conf.cy--;
+    }
+}
+
+void editor_set_cursor(int line, int col)
+{
+    if (line > edit_conf.numrows)
+        line = edit_conf.numrows;
+    if (line < 0)
+        line = 0;
+
+    if (line < edit_conf.row_offset)
+        edit_conf.row_offset = line;
+    else if (line >= edit_conf.row_offset + edit_conf.screen_rows)
+        edit_conf.row_offset = line - edit_conf.screen_rows + 1;
+    edit_conf.cy = line - edit_conf.row_offset;
+
+    if (line < edit_conf.numrows && col > edit_conf.rows[line].size)
+        col = edit_conf.rows[line].size;
+    if (col > editor_text_cols() - 1)
+        col = editor_text_cols() - 1;
+    edit_conf.cx = col < 0 ? 0 : col;
+}
+
+void journal_apply(journal_entry *entry, int undo)
+{
+    int row = entry->row;
+    if (row < 0 || row > edit_conf.numrows)
+        return;
+    editrow *target = row < edit_conf.numrows ? &edit_conf.rows[row] : NULL;
+    int col = entry->col;
+
+    edit_conf.journal.mute++;
+    switch (entry->type)
+    {
+    case JOURNAL_INSERT_CHARS:
+    case JOURNAL_DEL_CHARS:
+        if (!target)
+            break;
+        if ((entry->type == JOURNAL_INSERT_CHARS) != undo)
+        {
+            editor_row_insert_string(target, col, entry->bytes, entry->len);
+            if (!undo)
+                col += entry->len;
+        }
+        else
+        {
+            editor_row_del_chars(target, col, entry->len);
+        }
+        break;
+
+    case JOURNAL_INSERT_ROW:
+    case JOURNAL_DEL_ROW:
+        if ((entry->type == JOURNAL_INSERT_ROW) != undo)
+            editor_insert_row((char *)entry->bytes, entry->len, row);
+        else
+            editor_del_row(row);
+        break;
+
+    case JOURNAL_SPLIT_ROW:
+    case JOURNAL_JOIN_ROW:
+        if ((entry->type == JOURNAL_SPLIT_ROW) != undo)
+        {
+            editor_split_row(row, col);
+            if (!undo)
+            {
+                row++;
+                col = 0;
+            }
+        }
+        else
+        {
+            editor_join_row(row);
+        }
+        break;
+
+    case JOURNAL_APPEND:
+        if (!target)
+            break;
+        if (undo)
+            editor_row_del_chars(target, col, entry->len);
+        else
+            editor_row_append_string(target, (char *)entry->bytes, entry->len);
+        break;
+
+    case JOURNAL_DEL_BLOCK:
+    case JOURNAL_PUT_BLOCK:
+    {
+        int end_row, end_col;
+        block_end(row, col, entry->bytes, entry->len, &end_row, &end_col);
+        if ((entry->type == JOURNAL_PUT_BLOCK) != undo)
+        {
+            editor_put_block(row, col, entry->bytes, entry->len);
+            if (!undo)
+            {
+                row = end_row;
+                col = end_col;
+            }
+        }
+        else
+        {
+            editor_del_block(row, col, end_row, end_col);
+        }
+        break;
+    }
+    }
+    edit_conf.journal.mute--;
+
+    editor_set_cursor(row, col);
+}
+
+// Undoes one record and returns whether it was chained to the record before it.
+int journal_undo_record()
+{
+    undo_journal *j = &edit_conf.journal;
+    unsigned int body;
+    int start = j->cursor - varint_get_reversed(&j->data[j->cursor], &body) - body;
+    journal_entry entry;
+    journal_decode(&j->data[start], &entry);
+    entry.row = j->cursor_row;
+
+    j->cursor = start;
+    j->cursor_row -= entry.drow;
+    j->run_start = -1;
+    j->undo_entries--;
+    j->redo_entries++;
+    journal_apply(&entry, 1);
+    return entry.chained;
+}
+
+void editor_undo()
+{
+    undo_journal *j = &edit_conf.journal;
+    while (j->cursor > 0 && journal_undo_record())
+        ;
+}
+
+void journal_redo_record()
+{
+    undo_journal *j = &edit_conf.journal;
+    journal_entry entry;
+    journal_decode(&j->data[j->cursor], &entry);
+    entry.row = j->cursor_row + entry.drow;
+
+    j->cursor += entry.size;
+    j->cursor_row = entry.row;
+    j->run_start = -1;
+    j->undo_entries++;
+    j->redo_entries--;
+    journal_apply(&entry, 0);
+}
+
+void editor_redo()
+{
+    undo_journal *j = &edit_conf.journal;
+    if (j->cursor == j->len)
+        return;
+    do
+        journal_redo_record();
+    while (j->cursor < j->len && (j->data[j->cursor] & JOURNAL_CHAINED));
+}
+
+void cb_append(cache_buffer *cb, const char *s, int len)
+{
+    char *new = realloc(cb->cbuffer, cb->len + len);
+    if (new == NULL)
+        return;
+    memcpy(&new[cb->len], s, len);
+    cb->cbuffer = new;
+    cb->len += len;
+}
+void cb_free(cache_buffer *cb)
+{
+    free(cb->cbuffer);
+}
+
+int get_window_size(int *rows, int *cols)
+{
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+    {
+        return -1;
+    }
+    else
+    {
+        *cols = ws.ws_col;
+        *rows = ws.ws_row;
+        return 0;
+    }
+}
+
+char *parse_line(char *input, int input_len, int *len_out)
+{
+    int tabs = 0;
+    for (int i = 0; i < input_len; i++)
+    {
+        if (input[i] == '\t')
+        {
+            tabs++;
+        }
+    }
+    int new_len = input_len + 3 * tabs;
+    char *output = malloc(new_len);
+    int diff = 0;
+    for (int i = 0; i < input_len; i++)
+    {
+        if (input[i] == '\t')
+        {
+            for (int j = 0; j < 4; j++)
+            {
+                output[i + diff] = ' ';
+                diff++;
+            }
+            diff--;
+        }
+        else
+        {
+            output[i + diff] = input[i];
+        }
+    }
+    *len_out = new_len;
+    return output;
+}
+
+// Each cell covers an equal slice of the file. Once there are more index chunks than cells the
+// bounds snap to chunk edges, so the pane costs O(screen_rows log n) however long the file is;
+// only slices shorter than a chunk or two scan rows.
+void render_minimap_cell(cache_buffer *cbuf, int y)
+{
+    int rows = edit_conf.screen_rows, n = edit_conf.numrows;
+    int from, to;
+    line_summary sum = {0};
+    if (n > rows)
+        line_index_refresh();
+    if (n <= rows)
+    {
+        from = y < n ? y : n;
+        to = y < n ? y + 1 : n;
+        if (from < to)
+            sum = row_summary(&edit_conf.rows[from]);
+    }
+    else if (edit_conf.index.nchunks >= rows)
+    {
+        int nchunks = edit_conf.index.nchunks;
+        sum = line_index_chunks((long long)y * nchunks / rows, (long long)(y + 1) * nchunks / rows, &from);
+        to = from + sum.rows;
+    }
+    else
+    {
+        from = (long long)y * n / rows;
+        to = (long long)(y + 1) * n / rows;
+        sum = line_index_range(from, to);
+    }
+
+    char buf[16];
+    int len = snprintf(buf, sizeof(buf), "\x1b[%dG|", editor_text_cols() + 1);
+    cb_append(cbuf, buf, len);
+    if (from == to)
+        return;
+
+    if (from < edit_conf.row_offset + rows && to > edit_conf.row_offset)
+        cb_append(cbuf, "\x1b[7m", 4);
+    cb_append(cbuf, sum.modified ? "+" : " ", 1);
+    if (sum.matches)
+        cb_append(cbuf, "\x1b[33m", 5);
+
+    long long avg = (sum.bytes - (to - from)) / (to - from);
+    int bar = avg * (MINIMAP_WIDTH - 1) / 80;
+    if (bar == 0 && avg > 0)
+        bar = 1;
+    if (bar > MINIMAP_WIDTH - 1)
+        bar = MINIMAP_WIDTH - 1;
+    for (int x = 0; x < MINIMAP_WIDTH - 1; x++)
+        cb_append(cbuf, x < bar ? (sum.matches ? "#" : "=") : " ", 1);
+    cb_append(cbuf, "\x1b[m", 3);
+}
+
+// Colours handed to render_row hooks; kept from row to row and only grown.
+unsigned char *render_colors;
+int render_colors_alloc;
+
+// Same layout as parse_line, but runs of characters are wrapped in the colours plugins asked for.
+// Returns 0 without drawing anything when no hook coloured the row, which is then drawn plainly.
+int render_row_colored(cache_buffer *cbuf, int filerow, int cols)
+{
+    editrow *row = &edit_conf.rows[filerow];
+    if (row->size + 1 > render_colors_alloc)
+    {
+        render_colors_alloc = (row->size + 1) * 2;
+        render_colors = realloc(render_colors, render_colors_alloc);
+    }
+    unsigned char *colors = render_colors;
+    memset(colors, 0, row->size + 1);
+    PLUGIN_HOOK(render_row, filerow, row->chars, row->size, colors);
+    int colored = 0;
+    while (colored < row->size && !(colors[colored] & 7))
+        colored++;
+    if (colored == row->size)
+        return 0;
+
+    int current = 0, width = 0;
+    for (int j = 0; j < row->size && width < cols;)
+    {
+        if ((colors[j] & 7) != current)
+        {
+            current = colors[j] & 7;
+            char sgr[8];
+            int len = snprintf(sgr, sizeof(sgr), "\x1b[%dm", current ? 30 + current : 39);
+            cb_append(cbuf, sgr, len);
+        }
+        if (row->chars[j] == '\t')
+        {
+            int len = cols - width < 4 ? cols - width : 4;
+            cb_append(cbuf, "    ", len);
+            width += len;
+            j++;
+            continue;
+        }
+        int run = 0;
+        while (j + run < row->size && width + run < cols && row->chars[j + run] != '\t' && (colors[j + run] & 7) == current)
+            run++;
+        cb_append(cbuf, &row->chars[j], run);
+        width += run;
+        j += run;
+    }
+    if (current)
+        cb_append(cbuf, "\x1b[39m", 5);
+    return 1;
+}
+
+void render_editor(cache_buffer *cbuf)
+{
+    int cols = editor_text_cols();
+    for (int y = 0; y < edit_conf.screen_rows; y++)
+    {
+        int filerow = y + edit_conf.row_offset;
+        // Erase first: after a full-width row the cursor sits on the last column and \x1b[K would clear it.
+        cb_append(cbuf, "\x1b[K", 3);
+        if (filerow >= edit_conf.numrows)
+        {
+            if (y == 2 && edit_conf.numrows == 0)
+            {
+                char welcome[80];
+                int welcome_len = snprintf(welcome, sizeof(welcome), "RPGEditor version %s", CURRENT_VERSION);
+                if (welcome_len > edit_conf.screen_cols)
+                    welcome_len = edit_conf.screen_cols;
+
+                int padding = (edit_conf.screen_cols - welcome_len) / 2;
+
+                if (padding)
+                {
+                    cb_append(cbuf, "~", 1);
+                    padding--;
+                }
+                while (padding--)
+                {
+                    cb_append(cbuf, " ", 1);
+                }
+
+                cb_append(cbuf, welcome, welcome_len);
+            }
+
+            else
+            {
+                cb_append(cbuf, "~", 1);
+            }
+        }
+        else if (!plugins.n_render_row || !render_row_colored(cbuf, filerow, cols))
+        {
+            int len = edit_conf.rows[filerow].size;
+            if (len > cols)
+                len = cols;
+            int out_len = 0;
+            char *parsed = parse_line(edit_conf.rows[filerow].chars, len, &out_len);
+            cb_append(cbuf, parsed, out_len < cols ? out_len : cols);
+            free(parsed);
+        }
+
+        if (cols < edit_conf.screen_cols)
+            render_minimap_cell(cbuf, y);
+
+        cb_append(cbuf, "\r\n", 2);
+    }
+}
+
+// Three significant figures at most: 950, 9.8k, 98k, 1.2M.
+void format_count(char *buf, int size, long long n)
+{
+    const char *units = "kMGT";
+    if (n < 1000)
+    {
+        snprintf(buf, size, "%lld", n);
+        return;
+    }
+    double value = n / 1000.0;
+    while (value >= 1000 && units[1])
+    {
+        value /= 1000;
+        units++;
+    }
+    snprintf(buf, size, value < 10 ? "%.1f%c" : "%.0f%c", value, *units);
+}
+
+void render_status_bar(cache_buffer *cbuf)
+{
+    cb_append(cbuf, "\x1b[7m", 4);
+    char status[64], r_status[128], saved[48] = "", tag[24] = "";
+
+    if (buffers.count > 1)
+        snprintf(tag, sizeof(tag), "[%d/%d] ", buffers.current + 1, buffers.count);
+    int len = snprintf(status, sizeof(status), "%s%.20s - %d lines%s%s%s", tag,
+                       edit_conf.file_name ? edit_conf.file_name : "[No Name]", edit_conf.numrows,
+                       edit_conf.edits != edit_conf.saved_edits ? " (modified)" : "",
+                       edit_conf.watch.conflict ? " (changed on disk)" : "",
+                       edit_conf.watch.follow ? " (follow)" : "");
+    if (edit_conf.status_msg[0] && monotonic_ms() - edit_conf.status_msg_ms < STATUS_MSG_MS)
+        len = snprintf(status, sizeof(status), "%s", edit_conf.status_msg);
+    if (len >= (int)sizeof(status))
+        len = sizeof(status) - 1;
+
+    if (edit_conf.autosave)
+    {
+        snprintf(saved, sizeof(saved), "saving... | ");
+    }
+    else if (edit_conf.save_errno)
+    {
+        snprintf(saved, sizeof(saved), "NOT SAVED | ");
+    }
+    else if (edit_conf.autosaved_at)
+    {
+        struct tm tm;
+        localtime_r(&edit_conf.autosaved_at, &tm);
+        snprintf(saved, sizeof(saved), "saved %02d:%02d:%02d in %lld ms | ",
+                 tm.tm_hour, tm.tm_min, tm.tm_sec, edit_conf.autosave_took_ms);
+    }
+    char words[8], chars[8], bytes[8];
+    format_count(words, sizeof(words), edit_conf.stats.words);
+    format_count(chars, sizeof(chars), edit_conf.stats.chars);
+    format_count(bytes, sizeof(bytes), edit_conf.stats.bytes);
+    int line = edit_conf.cy + 1 + edit_conf.row_offset;
+    // on a narrow screen the save time goes first, then everything but the word count
+    int rlen = 0;
+    for (int detail = 3; detail >= 0; detail--)
+    {
+        if (detail == 3)
+            rlen = snprintf(r_status, sizeof(r_status), "%s%s words %s chars %sB max %d | %d/%d", saved, words,
+                            chars, bytes, edit_conf.stats.longest, line, edit_conf.numrows);
+        else if (detail == 2)
+            rlen = snprintf(r_status, sizeof(r_status), "%s words %s chars %sB max %d | %d/%d", words, chars,
+                            bytes, edit_conf.stats.longest, line, edit_conf.numrows);
+        else if (detail == 1)
+            rlen = snprintf(r_status, sizeof(r_status), "%s words | %d/%d", words, line, edit_conf.numrows);
+        else
+            rlen = snprintf(r_status, sizeof(r_status), "%d/%d", line, edit_conf.numrows);
+        if (len + 1 + rlen <= edit_conf.screen_cols)
+            break;
+    }
+
+    if (len > edit_conf.screen_cols)
+        len = edit_conf.screen_cols;
+    cb_append(cbuf, status, len);
+
+    while (len < edit_conf.screen_cols)
+    {
+        if (edit_conf.screen_cols - len == rlen)
+        {
+            cb_append(cbuf, r_status, rlen);
+            break;
+        }
+        else
+        {
+            cb_append(cbuf, " ", 1);
+            len++;
+        }
+    }
+    cb_append(cbuf, "\x1b[m", 3);
+}
+
+void render_inventory_options(cache_buffer *cbuf, int status)
+{
+    switch (status)
+    {
+    case 0:
+        cb_append(cbuf, "BUY\r\n", 5);
+        break;
+    case 1:
+        cb_append(cbuf, "EQUIP\r\n", 7);
+        break;
+    case 2:
+        cb_append(cbuf, "EQUIPPED\r\n", 10);
+        break;
+    }
+}
+
+void render_inventory(cache_buffer *cbuf)
+{
+    cb_append(cbuf, "---INVENTORY---\r\n", 17);
+    cb_append(cbuf, "\r\n", 2);
+    cb_append(cbuf, "WEAPONS:\r\n", 10);
+
+    cb_append(cbuf, "  STAFF OF INSERTION - ", 23);
+    render_inventory_options(cbuf, inventory.insert);
+
+    cb_append(cbuf, "  SWORD OF REMOVAL - ", 21);
+    render_inventory_options(cbuf, inventory.delete);
+
+    cb_append(cbuf, "  BOW OF COMMAND - ", 19);
+    render_inventory_options(cbuf, inventory.command);
+
+    cb_append(cbuf, "\r\n", 2);
+    cb_append(cbuf, "OTHER:\r\n", 8);
+
+    cb_append(cbuf, "  FAST TRAVEL - ", 16);
+    render_inventory_options(cbuf, inventory.fast_travel);
+
+    cb_append(cbuf, "  HELMET - ", 11);
+    render_inventory_options(cbuf, inventory.helmet);
+
+    cb_append(cbuf, "  MAP - ", 8);
+    render_inventory_options(cbuf, inventory.map);
+
+    cb_append(cbuf, "  GRENADE - ", 12);
+    render_inventory_options(cbuf, inventory.nade);
+
+    cb_append(cbuf, "  DLC - ", 8);
+    render_inventory_options(cbuf, inventory.dlc);
+
+    cb_append(cbuf, "\r\n", 2);
+    cb_append(cbuf, "STATS:\r\n", 8);
+
+    char journal[80];
+    int len = snprintf(journal, sizeof(journal), "  JOURNAL - %d UNDO / %d REDO, %d/%d KiB\r\n",
+                       edit_conf.journal.undo_entries, edit_conf.journal.redo_entries,
+                       (edit_conf.journal.alloc + 1023) / 1024, edit_conf.journal.limit / 1024);
+    cb_append(cbuf, journal, len);
+
+    char lines[96];
+    len = snprintf(lines, sizeof(lines), "  LINE POOL - %d LINES FOR %lld ROWS, %lld KiB HELD, %lld KiB SHARED\r\n",
+                   pool.entries, pool.refs, (pool.bytes + 1023) / 1024, (pool.saved + 1023) / 1024);
+    cb_append(cbuf, lines, len);
+
+    doc_stats *st = &edit_conf.stats;
+    char document[112];
+    len = snprintf(document, sizeof(document), "  DOCUMENT - %lld BYTES, %lld WORDS, %lld CHARS, LONGEST LINE %d\r\n",
+                   st->bytes, st->words, st->chars, st->longest);
+    cb_append(cbuf, document, len);
+
+    // one column per doubling of line length, scaled to the fullest bucket
+    const char *levels = " .:-=+*#%@";
+    char bars[STATS_BUCKETS + 1];
+    long long most = 1;
+    int top = stats_bucket(st->longest);
+    for (int b = 0; b <= top; b++)
+        if (st->histogram[b] > most)
+            most = st->histogram[b];
+    for (int b = 0; b <= top; b++)
+        bars[b] = levels[st->histogram[b] ? 1 + st->histogram[b] * 8 / most : 0];
+    bars[top + 1] = '\0';
+    char histogram[96];
+    len = snprintf(histogram, sizeof(histogram), "  LINE LENGTHS - [%s] 0 TO %d BYTES, ONE COLUMN PER DOUBLING\r\n",
+                   bars, st->longest);
+    cb_append(cbuf, histogram, len);
+}
+void inventory_handle_enter()
+{
+    switch (edit_conf.cy)
+    {
+    case 3:
+        inventory.insert = 2;
+        inventory.command = 1;
+        inventory.delete = 1;
+        break;
+    case 4:
+        inventory.insert = 1;
+        inventory.command = 1;
+        inventory.delete = 2;
+        break;
+    case 5:
+        inventory.insert = 1;
+        inventory.command = 2;
+        inventory.delete = 1;
+        break;
+    case 8:
+        inventory.fast_travel++;
+        if (inventory.fast_travel == 3)
+            inventory.fast_travel = 1;
+        break;
+    case 9:
+        inventory.helmet++;
+        if (inventory.helmet == 3)
+            inventory.helmet = 1;
+        break;
+    case 10:
+        inventory.map++;
+        if (inventory.map == 3)
+            inventory.map = 1;
+        break;
+    case 11:
+        inventory.nade++;
+        if (inventory.nade == 3)
+            inventory.nade = 1;
+        break;
+    case 12:
+        inventory.dlc++;
+        if (inventory.dlc == 3)
+            inventory.dlc = 1;
+        plugins_enable(inventory.dlc == 2);
+        break;
+    }
+}
+
+// Everything refresh_screen writes for one frame; --verify feeds the same bytes to its emulator.
+void editor_render_frame(cache_buffer *cb)
+{
+    cb_append(cb, "\x1b[?25l", 6);
+    cb_append(cb, "\x1b[H", 3);
+
+    if (inventory.active == 1)
+    {
+        cb_append(cb, "\x1b[2J", 4);
+        render_inventory(cb);
+    }
+    else
+    {
+        render_editor(cb);
+        render_status_bar(cb);
+    }
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", edit_conf.cy + 1, edit_conf.cx + 1);
+    cb_append(cb, buf, strlen(buf));
+    cb_append(cb, "\x1b[?25h", 6);
+}
+
+void refresh_screen()
+{
+    cache_buffer cb = CBUFFER_INIT;
+    editor_render_frame(&cb);
+    write(STDOUT_FILENO, cb.cbuffer, cb.len);
+    cb_free(&cb);
+}
+
+void editor_set_status(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(edit_conf.status_msg, sizeof(edit_conf.status_msg), fmt, ap);
+    va_end(ap);
+    edit_conf.status_msg_ms = monotonic_ms();
+}
+
+void die(const char *s)
+{
+    refresh_screen();
+    perror(s);
+    exit(1);
+}
+
+// Replays swap records on top of the freshly loaded file and returns how many bytes were intact.
+int swap_replay(const unsigned char *data, int len, int *last_row)
+{
+    int pos = 0;
+    int row = *last_row;
+    edit_conf.log_mute++;
+    while (pos < len)
+    {
+        journal_entry entry;
+        journal_decode(&data[pos], &entry);
+        if (entry.type < JOURNAL_INSERT_CHARS || entry.type > JOURNAL_PUT_BLOCK || entry.len < 0 || entry.size > len - pos)
+            break;
+        unsigned int body;
+        varint_get_reversed(&data[pos + entry.size], &body);
+        if ((int)body + varint_size(body) != entry.size)
+            break;
+
+        entry.row = row + entry.drow;
+        row = entry.row;
+        journal_apply(&entry, 0);
+        pos += entry.size;
+    }
+    edit_conf.log_mute--;
+    *last_row = row;
+    return pos;
+}
+
+void swap_open(const char *file_name)
+{
+    struct stat st;
+    if (stat(file_name, &st) == -1)
+        return;
+
+    swap_journal *swap = calloc(1, sizeof(swap_journal));
+    swap->path = sidecar_path(file_name, "rpgswp");
+    swap->fd = open(swap->path, O_RDWR | O_CREAT | O_APPEND, 0600);
+    if (swap->fd == -1)
+    {
+        free(swap->path);
+        free(swap);
+        return;
+    }
+
+    swap_header header;
+    swap_header_for(&header, &st, 0);
+    struct stat swap_st;
+    int len = fstat(swap->fd, &swap_st) == 0 ? swap_st.st_size : 0;
+    int valid = 0;
+
+    // zero padding makes a torn record at the tail decode as garbage instead of reading past the end
+    unsigned char *data = calloc(len + 16, 1);
+    if (len >= (int)sizeof(header) && pread(swap->fd, data, len, 0) == len &&
+        memcmp(data, &header, offsetof(swap_header, start_row)) == 0)
+    {
+        memcpy(&header, data, sizeof(header));
+        swap->start_row = header.start_row;
+        swap->last_row = header.start_row;
+        valid = sizeof(header) + swap_replay(&data[sizeof(header)], len - sizeof(header), &swap->last_row);
+        swap->logged = valid - sizeof(header);
+        if (swap->logged)
+            edit_conf.edits++;
+    }
+    free(data);
+
+    // records logged against another version of the file, after a checkout say, cannot be replayed
+    // on this one, so they are set aside for the user rather than truncated away
+    if (valid == 0 && len > (int)sizeof(header))
+    {
+        char *stale = sidecar_path(file_name, "rpgswp.stale");
+        close(swap->fd);
+        swap->fd = -1;
+        if (rename(swap->path, stale) == 0)
+        {
+            swap->fd = open(swap->path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0600);
+            editor_set_status("Swap file did not match the file, kept as %s", stale);
+        }
+        else
+        {
+            editor_set_status("Swap file did not match the file, journaling is off: %s", strerror(errno));
+        }
+        free(stale);
+        if (swap->fd == -1)
+        {
+            free(swap->path);
+            free(swap);
+            return;
+        }
+    }
+    if (valid == 0)
+    {
+        if (ftruncate(swap->fd, 0) == 0 && write(swap->fd, &header, sizeof(header)) == sizeof(header))
+            valid = sizeof(header);
+    }
+    else if (valid < len)
+    {
+        ftruncate(swap->fd, valid);
+    }
+
+    pthread_mutex_init(&swap->lock, NULL);
+    pthread_cond_init(&swap->wake, NULL);
+    if (pthread_create(&swap->thread, NULL, swap_writer, swap) != 0)
+    {
+        close(swap->fd);
+        free(swap->path);
+        free(swap);
+        return;
+    }
+    edit_conf.swap = swap;
+}
+
+// Maps a regular file; anything else, a pipe say, is read into memory instead.
+char *file_contents(int fd, struct stat *st, long long *size, int *mapped)
+{
+    *mapped = S_ISREG(st->st_mode) && st->st_size > 0;
+    if (*mapped)
+    {
+        char *data = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+            return NULL;
+        madvise(data, st->st_size, MADV_SEQUENTIAL);
+        *size = st->st_size;
+        return data;
+    }
+
+    long long alloc = 4096, len = 0;
+    char *data = malloc(alloc);
+    ssize_t got;
+    while ((got = read(fd, &data[len], alloc - len)) > 0)
+    {
+        len += got;
+        if (len == alloc)
+            data = realloc(data, alloc *= 2);
+    }
+    *size = len;
+    return data;
+}
+
+// Reads a file into rows without starting the file watch or the swap journal. With `cached`, the
+// line cache supplies the line lengths for as much of the file as it still describes.
+int editor_load(char *file_name, int cached)
+{
+    free(edit_conf.file_name);
+    edit_conf.file_name = strdup(file_name);
+    edit_conf.line_cache = cached;
+
+    int fd = open(file_name, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    struct stat st;
+    long long size;
+    int mapped;
+    char *data = fstat(fd, &st) == 0 ? file_contents(fd, &st, &size, &mapped) : NULL;
+    if (!data)
+    {
+        close(fd);
+        return -1;
+    }
+
+    line_cache_header header;
+    int body_len = 0, body_alloc = 0, used = 0;
+    unsigned char *body = NULL;
+    if (cached && mapped && size >= LINE_CACHE_MIN)
+        body = line_cache_read(file_name, fd, &st, &header, &body_alloc);
+    int spans = body_alloc;
+    if (spans > 0 && !pool.off)
+        pool_reserve(pool.entries + header.numrows);
+
+    char *lines[4096];
+    int lens[4096];
+    int n = 0;
+    long long pos = 0;
+    int eol_seen = 0;
+    edit_conf.crlf = 0;
+    edit_conf.no_final_newline = size > 0 && data[size - 1] != '\n';
+    edit_conf.log_mute++;
+    edit_conf.loading++;
+    edit_conf.stats.deferred++;
+    line_index_invalidate();
+    while (pos < size)
+    {
+        long long span;
+        if (used < spans)
+        {
+            unsigned int cached_span;
+            int step = varint_get(&body[used], &cached_span);
+            span = cached_span;
+            // the last cached line had no newline and the file has grown since, so it goes on
+            if (data[pos + span - 1] != '\n' && pos + span < size)
+            {
+                spans = used;
+                continue;
+            }
+            used += step;
+            body_len = used;
+        }
+        else
+        {
+            char *end = memchr(&data[pos], '\n', size - pos);
+            span = end ? end + 1 - &data[pos] : size - pos;
+            if (cached && size >= LINE_CACHE_MIN)
+                line_cache_put(&body, &body_len, &body_alloc, span);
+        }
+
+        if (!eol_seen && data[pos + span - 1] == '\n')
+        {
+            eol_seen = 1;
+            edit_conf.crlf = span > 1 && data[pos + span - 2] == '\r';
+        }
+        int len = span;
+        while (len > 0 && (data[pos + len - 1] == '\n' || data[pos + len - 1] == '\r'))
+            len--;
+        lines[n] = &data[pos];
+        lens[n++] = len;
+        if (n == (int)(sizeof(lens) / sizeof(lens[0])))
+        {
+            editor_splice_rows(edit_conf.numrows, 0, lines, lens, n);
+            n = 0;
+        }
+        pos += span;
+    }
+    editor_splice_rows(edit_conf.numrows, 0, lines, lens, n);
+    edit_conf.stats.deferred--;
+    edit_conf.loading--;
+    edit_conf.log_mute--;
+    journal_clear(&edit_conf.journal);
+    if (!edit_conf.stats.deferred)
+        stats_compute();
+
+    if (spans > 0)
+    {
+        edit_conf.row_offset = header.row_offset;
+        editor_set_cursor(header.row, header.col);
+    }
+    if (cached && size >= LINE_CACHE_MIN && body_len > used)
+    {
+        line_cache_header_for(&header, &st, line_cache_sample(fd, size));
+        line_cache_write(file_name, &header, body, body_len);
+    }
+    free(body);
+
+    int newline;
+    unsigned int hash = file_tail_sample(fd, st.st_size, &newline);
+    watch_remember(&st, hash, newline);
+    if (mapped)
+        munmap(data, size);
+    else
+        free(data);
+    close(fd);
+    return 0;
+}
+
+int editor_open(char *file_name)
+{
+    if (editor_load(file_name, 1) == -1)
+        return -1;
+    watch_open(file_name);
+    swap_open(file_name);
+    char *recovery = sidecar_path(file_name, "rpgrecover");
+    if (access(recovery, F_OK) == 0)
+        editor_set_status("Edits that conflicted with a change on disk are in %s", recovery);
+    free(recovery);
+    return 0;
+}
+
+char *editor_rows_to_string(int *buflen)
+{
+    int eol_len = 1 + edit_conf.crlf;
+    int total_len = 0;
+    for (int j = 0; j < edit_conf.numrows; j++)
+    {
+        total_len += edit_conf.rows[j].size + eol_len;
+    }
+    if (edit_conf.numrows > 0 && edit_conf.no_final_newline)
+        total_len -= eol_len;
+    *buflen = total_len;
+    char *buf = malloc(total_len + eol_len);
+    char *buf_iter = buf;
+    for (int j = 0; j < edit_conf.numrows; j++)
+    {
+        memcpy(buf_iter, edit_conf.rows[j].chars, edit_conf.rows[j].size);
+        buf_iter += edit_conf.rows[j].size;
+        // the last terminator lands past buflen when the file had none
+        memcpy(buf_iter, edit_conf.crlf ? "\r\n" : "\n", eol_len);
+        buf_iter += eol_len;
+    }
+    return buf;
+}
+
+// On failure the cause is kept in save_errno, since cleaning up may clobber errno.
+int editor_save()
+{
+    if (edit_conf.file_name == NULL)
+    {
+        edit_conf.save_errno = EINVAL;
+        return -1;
+    }
+    int len;
+    char *buf = editor_rows_to_string(&len);
+    int fd = open(edit_conf.file_name, O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+    {
+        edit_conf.save_errno = errno;
+        free(buf);
+        return -1;
+    }
+    ssize_t written = -1;
+    if (ftruncate(fd, len) != -1)
+        written = write(fd, buf, len);
+    if (written != len)
+    {
+        // a short write does not set errno
+        edit_conf.save_errno = written == -1 ? errno : EIO;
+        close(fd);
+        free(buf);
+        return -1;
+    }
+
+    struct stat st;
+    int swap_row;
+    long long swap_at = swap_mark(&swap_row);
+    if (fstat(fd, &st) == 0)
+    {
+        int newline;
+        unsigned int hash = file_tail_sample(fd, st.st_size, &newline);
+        swap_rebase(&st, swap_at, swap_row);
+        watch_remember(&st, hash, newline);
+        line_cache_store(fd, &st);
+    }
+    editor_mark_saved(edit_conf.edits);
+    close(fd);
+    free(buf);
+    return 0;
+}
+
+// Writes the whole document next to the file, for edits that cannot be saved over it.
+int recovery_write()
+{
+    char *path = sidecar_path(edit_conf.file_name, "rpgrecover");
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    free(path);
+    if (fd == -1)
+        return -1;
+    int len;
+    char *buf = editor_rows_to_string(&len);
+    int ok = write(fd, buf, len) == len && fsync(fd) == 0;
+    free(buf);
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+// Splits `buf` into lines the way editor_open does; a trailing piece without newline is kept.
+int split_lines(char *buf, long long len, char ***lines_out, int **lens_out)
+{
+    int n = 0;
+    for (char *p = buf; (p = memchr(p, '\n', buf + len - p)) != NULL; p++)
+        n++;
+    char **lines = malloc(sizeof(char *) * (n + 1));
+    int *lens = malloc(sizeof(int) * (n + 1));
+
+    n = 0;
+    char *start = buf;
+    while (start < buf + len)
+    {
+        char *end = memchr(start, '\n', buf + len - start);
+        char *next = end ? end + 1 : buf + len;
+        if (!end)
+            end = buf + len;
+        while (end > start && (end[-1] == '\r' || end[-1] == '\n'))
+            end--;
+        lines[n] = start;
+        lens[n++] = end - start;
+        start = next;
+    }
+    *lines_out = lines;
+    *lens_out = lens;
+    return n;
+}
+
+void editor_follow_tail()
+{
+    int last = edit_conf.numrows > 0 ? edit_conf.numrows - 1 : 0;
+    edit_conf.row_offset = edit_conf.numrows > edit_conf.screen_rows ? edit_conf.numrows - edit_conf.screen_rows : 0;
+    editor_set_cursor(last, 0);
+}
+
+// The file only grew: append the new bytes as rows in one go.
+void editor_append_tail(reload_job *job)
+{
+    file_watch *w = &edit_conf.watch;
+    char **lines;
+    int *lens;
+    int n = split_lines(job->buf, job->st.st_size - job->from, &lines, &lens);
+    int first = 0;
+
+    edit_conf.log_mute++;
+    edit_conf.loading++;
+    if (!w->tail_newline && edit_conf.numrows > 0 && n > 0)
+    {
+        editor_row_append_string(&edit_conf.rows[edit_conf.numrows - 1], lines[0], lens[0]);
+        first = 1;
+    }
+    editor_splice_rows(edit_conf.numrows, 0, &lines[first], &lens[first], n - first);
+    edit_conf.loading--;
+    edit_conf.log_mute--;
+
+    watch_remember(&job->st, job->tail_hash, job->tail_newline);
+    edit_conf.no_final_newline = job->st.st_size > 0 && !job->tail_newline;
+    swap_restat(&job->st);
+    if (w->follow)
+        editor_follow_tail();
+
+    free(lines);
+    free(lens);
+}
+
+// The file was rewritten: keep the rows shared by the old and new contents at both ends and only
+// replace the ones in between.
+void editor_reload_diff(reload_job *job)
+{
+    char **lines;
+    int *lens;
+    int n = split_lines(job->buf, job->st.st_size, &lines, &lens);
+
+    int prefix = 0;
+    while (prefix < n && prefix < edit_conf.numrows && edit_conf.rows[prefix].size == lens[prefix] &&
+           memcmp(edit_conf.rows[prefix].chars, lines[prefix], lens[prefix]) == 0)
+        prefix++;
+    int suffix = 0;
+    while (suffix < n - prefix && suffix < edit_conf.numrows - prefix)
+    {
+        editrow *row = &edit_conf.rows[edit_conf.numrows - 1 - suffix];
+        if (row->size != lens[n - 1 - suffix] || memcmp(row->chars, lines[n - 1 - suffix], row->size) != 0)
+            break;
+        suffix++;
+    }
+
+    int del = edit_conf.numrows - prefix - suffix;
+    int ins = n - prefix - suffix;
+    if (del || ins)
+    {
+        edit_conf.log_mute++;
+        edit_conf.loading++;
+        editor_splice_rows(prefix, del, &lines[prefix], &lens[prefix], ins);
+        edit_conf.loading--;
+        edit_conf.log_mute--;
+        journal_clear(&edit_conf.journal);
+        editor_set_status("Reloaded: %d lines replaced by %d", del, ins);
+    }
+
+    int swap_row;
+    long long swap_at = swap_mark(&swap_row);
+    swap_rebase(&job->st, swap_at, swap_row);
+    watch_remember(&job->st, job->tail_hash, job->tail_newline);
+    edit_conf.no_final_newline = job->st.st_size > 0 && !job->tail_newline;
+
+    if (edit_conf.watch.follow)
+        editor_follow_tail();
+    else
+        editor_set_cursor(edit_conf.cy + edit_conf.row_offset, edit_conf.cx);
+
+    free(lines);
+    free(lens);
+}
+
+void watch_conflict(struct stat *st, unsigned int tail_hash, int tail_newline)
+{
+    watch_remember(st, tail_hash, tail_newline);
+    edit_conf.watch.conflict = 1;
+    editor_set_status("File changed on disk; autosave paused, saving overwrites it");
+}
+
+// A rewrite read in the background is only applied if nothing was typed meanwhile; an append
+// never conflicts with edits.
+void watch_reload_apply(reload_job *job)
+{
+    if (!job->ok)
+        return;
+    if (job->from > 0)
+        editor_append_tail(job);
+    else if (edit_conf.edits == edit_conf.saved_edits)
+        editor_reload_diff(job);
+    else
+        watch_conflict(&job->st, job->tail_hash, job->tail_newline);
+}
+
+// Returns whether a finished read changed the buffer or the status line.
+int watch_reload_finish()
+{
+    reload_job *job = edit_conf.watch.reload;
+    if (!job || pthread_tryjoin_np(job->thread, NULL) != 0)
+        return 0;
+    edit_conf.watch.reload = NULL;
+    watch_reload_apply(job);
+    reload_free(job);
+    return 1;
+}
+
+// Takes over `fd`. If no thread can be started the read happens right here.
+void watch_reload_start(int fd, struct stat *st, long long from)
+{
+    reload_job *job = calloc(1, sizeof(reload_job));
+    job->fd = fd;
+    job->st = *st;
+    job->from = from;
+    if (pthread_create(&job->thread, NULL, reload_worker, job) == 0)
+    {
+        edit_conf.watch.reload = job;
+        return;
+    }
+    reload_worker(job);
+    watch_reload_apply(job);
+    reload_free(job);
+}
+
+// Returns whether the buffer or the status line changed.
+int watch_check()
+{
+    file_watch *w = &edit_conf.watch;
+    if (edit_conf.autosave || w->reload)
+    {
+        w->pending = 1;
+        return 0;
+    }
+    w->pending = 0;
+
+    int fd = open(edit_conf.file_name, O_RDONLY);
+    if (fd == -1)
+        return 0;
+    struct stat st;
+    int changed = 0;
+    if (fstat(fd, &st) == 0 && !watch_is_known(&st))
+    {
+        int newline;
+        if (st.st_size > w->size && st.st_ino == w->ino &&
+            file_tail_sample(fd, w->size, &newline) == w->tail_hash)
+        {
+            watch_reload_start(fd, &st, w->size);
+            return 1;
+        }
+        if (edit_conf.edits == edit_conf.saved_edits)
+        {
+            watch_reload_start(fd, &st, 0);
+            return 1;
+        }
+        watch_conflict(&st, file_tail_sample(fd, st.st_size, &newline), newline);
+        changed = 1;
+    }
+    close(fd);
+    return changed;
+}
+
+// Called after every keypress and whenever input has been idle for a tick; returns whether the
+// screen needs to be redrawn.
+int editor_tick()
+{
+    int redraw = autosave_finish(0);
+    redraw |= watch_reload_finish();
+    if (edit_conf.watch.pending)
+        redraw |= watch_check();
+    if (edit_conf.autosave || edit_conf.watch.reload || edit_conf.edits == edit_conf.saved_edits)
+        return redraw;
+    // after a conflicting change on disk the edits stay in the swap until the user saves over it,
+    // or are written to the recovery file on quit
+    if (edit_conf.watch.conflict && !edit_conf.save_requested)
+        return redraw;
+    if (edit_conf.save_errno && edit_conf.failed_edits == edit_conf.edits && !edit_conf.save_requested)
+        return redraw;
+
+    long long now = monotonic_ms();
+    if (edit_conf.save_requested || now - edit_conf.last_edit_ms >= AUTOSAVE_IDLE_MS ||
+        now - edit_conf.autosave_started_ms >= AUTOSAVE_INTERVAL_MS)
+        redraw |= autosave_start();
+    return redraw;
+}
+
+// Every buffer is ticked, parked ones included, so their autosaves are reaped, their swaps
+// rebased and their files watched while another buffer is on screen. Returns whether the
+// active buffer needs a redraw.
+int editor_tick_buffers()
+{
+    int active = buffers.current;
+    int redraw = 0;
+    for (int j = 0; j < buffers.count; j++)
+    {
+        buffer_switch(j);
+        if (edit_conf.watch.fd >= 0 && watch_drain())
+            edit_conf.watch.pending = 1;
+        int changed = editor_tick();
+        if (j == active)
+            redraw = changed;
+    }
+    buffer_switch(active);
+    return redraw;
+}
+
+// Runs a last autosave before the active document goes away. Edits that conflict with a change
+// on disk are written to the recovery file instead, since its swap is set aside on the next
+// open; the swap is only discarded once everything it holds is in one file or the other.
+void editor_flush()
+{
+    autosave_finish(1);
+    if (edit_conf.edits != edit_conf.saved_edits && !edit_conf.watch.conflict && autosave_start())
+        autosave_finish(1);
+    int kept = edit_conf.edits == edit_conf.saved_edits;
+    if (!kept && edit_conf.watch.conflict)
+        kept = recovery_write() == 0;
+    swap_close(kept);
+}
+
+void editor_quit()
+{
+    refresh_screen();
+    for (int j = buffers.count - 1; j >= 0; j--)
+    {
+        buffer_switch(j);
+        editor_flush();
+        line_cache_close();
+    }
+    exit(0);
+}
+
+void disable_raw_mode()
+{
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &edit_conf.original_term_mode) == -1)
+    {
+        die("tcsetattr");
+    }
+}
+
+void enable_raw_mode()
+{
+    if (tcgetattr(STDIN_FILENO, &edit_conf.original_term_mode) == -1)
+    {
+        die("tcgetattr");
+    }
+    struct termios raw = edit_conf.original_term_mode;
+
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_oflag &= ~(OPOST);
+    raw.c_iflag &= ~(IXON | ICRNL);
+
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
+    {
+        die("tcsetattr");
+    }
+
+    atexit(disable_raw_mode);
+}
+
+// Waits for input, ticking every buffer each TICK_MS so background work is picked up while idle;
+// a change to any buffer's file wakes the loop early.
+void editor_wait_input()
+{
+    struct pollfd *pfd = malloc(sizeof(struct pollfd) * (buffers.count + 1));
+    int nfds = 1;
+    pfd[0].fd = STDIN_FILENO;
+    pfd[0].events = POLLIN;
+    for (int j = 0; j < buffers.count; j++)
+    {
+        int fd = j == buffers.current ? edit_conf.watch.fd : buffers.parked[j].watch.fd;
+        if (fd < 0)
+            continue;
+        pfd[nfds].fd = fd;
+        pfd[nfds++].events = POLLIN;
+    }
+    while (1)
+    {
+        int ready = poll(pfd, nfds, TICK_MS);
+        if (ready > 0 && pfd[0].revents)
+            break;
+        if (editor_tick_buffers())
+            refresh_screen();
+    }
+    free(pfd);
+}
+
+int editor_read_key()
+{
+    int read_code;
+    char character;
+    editor_wait_input();
+    while ((read_code = read(STDIN_FILENO, &character, 1)) != 1)
+    {
+        if (read_code == -1 && errno != EAGAIN)
+            die("read");
+    }
+
+    if (character == '\x1b')
+    {
+        char seq[3];
         if (read(STDIN_FILENO, &seq[0], 1) != 1)
             return '\x1b';
         if (read(STDIN_FILENO, &seq[1], 1) != 1)
             return '\x1b';
         if (seq[0] == '[')
         {
-            if (seq[1] >= '0' && seq[1] <= '9')
+            if (seq[1] >= '0' && seq[1] <= '9')
+            {
+                if (read(STDIN_FILENO, &seq[2], 1) != 1)
+                    return '\x1b';
+                if (seq[2] == '~')
+                {
+                    switch (seq[1])
+                    {
+                    case '5':
+                        return PAGE_UP;
+                    case '6':
+                        return PAGE_DOWN;
+                    case '3':
+                        return DEL_KEY;
+                    }
+                }
+            }
+            else
+            {
+                switch (seq[1])
+                {
+                case 'A':
+                    return ARROW_UP;
+                case 'B':
+                    return ARROW_DOWN;
+                case 'C':
+                    return ARROW_RIGHT;
+                case 'D':
+                    return ARROW_LEFT;
+                case '3':
+                    return DEL_KEY;
+                }
+            }
+        }
+        return '\x1b';
+    }
+    return (unsigned char)character;
+}
+
+void editor_display_keypress(char character)
+{
+    if (iscntrl(character))
+    {
+        printf("%d\n", character);
+    }
+    else
+    {
+        printf("%d ('%c')\r\n", character, character);
+    }
+}
+
+// Reads a line of input on the status bar; returns NULL if cancelled with ESC.
+char *editor_prompt(const char *prompt)
+{
+    int cap = 32;
+    int len = 0;
+    char *buf = malloc(cap);
+    buf[0] = '\0';
+    while (1)
+    {
+        editor_set_status("%s%s", prompt, buf);
+        refresh_screen();
+
+        int c = editor_read_key();
+        if (c == '\x1b')
+        {
+            edit_conf.status_msg[0] = '\0';
+            free(buf);
+            return NULL;
+        }
+        else if (c == '\r')
+        {
+            edit_conf.status_msg[0] = '\0';
+            return buf;
+        }
+        else if ((c == BACKSPACE || c == CTRL_KEY('h')) && len > 0)
+        {
+            buf[--len] = '\0';
+        }
+        else if (c < 128 && isprint(c))
+        {
+            if (len + 1 == cap)
+            {
+                cap *= 2;
+                buf = realloc(buf, cap);
+            }
+            buf[len++] = c;
+            buf[len] = '\0';
+        }
+    }
+}
+
+// Puts `line` in the middle of the screen so a jump of any distance is a single redraw.
+void editor_jump_to(int line)
+{
+    if (line >= edit_conf.numrows)
+        line = edit_conf.numrows > 0 ? edit_conf.numrows - 1 : 0;
+    if (line < 0)
+        line = 0;
+    int offset = line - edit_conf.screen_rows / 2;
+    if (offset > edit_conf.numrows - edit_conf.screen_rows)
+        offset = edit_conf.numrows - edit_conf.screen_rows;
+    edit_conf.row_offset = offset > 0 ? offset : 0;
+    editor_set_cursor(line, edit_conf.cx);
+}
+
+void editor_page(int direction)
+{
+    int line = edit_conf.cy + edit_conf.row_offset + direction * edit_conf.screen_rows;
+    int offset = edit_conf.row_offset + direction * edit_conf.screen_rows;
+    if (offset > edit_conf.numrows - edit_conf.screen_rows)
+        offset = edit_conf.numrows - edit_conf.screen_rows;
+    edit_conf.row_offset = offset > 0 ? offset : 0;
+
+    if (line >= edit_conf.numrows)
+        line = edit_conf.numrows > 0 ? edit_conf.numrows - 1 : 0;
+    editor_set_cursor(line < 0 ? 0 : line, edit_conf.cx);
+}
+
+// Accepts a line number, a relative "+N"/"-N", or "N%" of the way through the file by bytes.
+void editor_fast_travel()
+{
+    char *target = editor_prompt("Fast travel to (line, +N, -N, N%): ");
+    if (!target)
+        return;
+
+    char *end;
+    double value = strtod(target, &end);
+    int current = edit_conf.cy + edit_conf.row_offset;
+    if (end == target)
+        editor_set_status("Unknown destination: %s", target);
+    else if (*end == '%')
+        editor_jump_to(line_index_row_at((long long)(line_index_total().bytes * value / 100)));
+    else if (target[0] == '+' || target[0] == '-')
+        editor_jump_to(current + (int)value);
+    else
+        editor_jump_to((int)value - 1);
+    free(target);
+}
+
+// An empty answer repeats the last search. Changing the term recounts matches through the line index.
+void editor_find()
+{
+    char *term = editor_prompt("Search: ");
+    if (!term)
+        return;
+    if (term[0] == '\0' || (edit_conf.search && strcmp(term, edit_conf.search) == 0))
+        free(term);
+    else
+    {
+        free(edit_conf.search);
+        edit_conf.search = term;
+        line_index_invalidate();
+    }
+    if (!edit_conf.search)
+        return;
+
+    int len = strlen(edit_conf.search);
+    int current = edit_conf.cy + edit_conf.row_offset;
+    for (int j = 1; j <= edit_conf.numrows; j++)
+    {
+        int line = (current + j) % edit_conf.numrows;
+        editrow *row = &edit_conf.rows[line];
+        char *match = memmem(row->chars, row->size, edit_conf.search, len);
+        if (match)
+        {
+            editor_jump_to(line);
+            editor_set_cursor(line, match - row->chars);
+            editor_set_status("%lld matches", line_index_total().matches);
+            return;
+        }
+    }
+    editor_set_status("Not found: %s", edit_conf.search);
+}
+
+enum grenadeOp
+{
+    GRENADE_PIN,
+    GRENADE_THROW,
+    GRENADE_YANK,
+    GRENADE_PUT,
+};
+
+// Pulling the pin marks the cursor and throwing blasts everything between the pin and the cursor
+// into the clipboard. Yanking copies the same span intact and putting inserts the clipboard.
+void editor_grenade(int op)
+{
+    int row = edit_conf.cy + edit_conf.row_offset;
+    int col = edit_conf.cx;
+    if (op == GRENADE_PIN)
+    {
+        edit_conf.mark_set = 1;
+        edit_conf.mark_row = row;
+        edit_conf.mark_col = col;
+        editor_set_status("Pin pulled at %d:%d", row + 1, col + 1);
+        return;
+    }
+    if (op == GRENADE_PUT)
+    {
+        if (!clipboard.text)
+        {
+            editor_set_status("Nothing yanked");
+            return;
+        }
+        int end_row, end_col;
+        block_end(row, col, clipboard.text, clipboard.len, &end_row, &end_col);
+        editor_put_block(row, col, clipboard.text, clipboard.len);
+        editor_set_cursor(end_row, end_col);
+        return;
+    }
+    if (!edit_conf.mark_set || edit_conf.numrows == 0)
+    {
+        editor_set_status("Pull the pin first");
+        return;
+    }
+
+    int r0 = edit_conf.mark_row, c0 = edit_conf.mark_col, r1 = row, c1 = col;
+    if (r0 > r1 || (r0 == r1 && c0 > c1))
+    {
+        r0 = row;
+        c0 = col;
+        r1 = edit_conf.mark_row;
+        c1 = edit_conf.mark_col;
+    }
+    if (r1 >= edit_conf.numrows)
+    {
+        r1 = edit_conf.numrows - 1;
+        c1 = edit_conf.rows[r1].size;
+    }
+    if (r0 > r1)
+        r0 = r1;
+    if (c0 > edit_conf.rows[r0].size)
+        c0 = edit_conf.rows[r0].size;
+    if (c1 > edit_conf.rows[r1].size)
+        c1 = edit_conf.rows[r1].size;
+    if (r0 == r1 && c0 > c1)
+        c0 = c1;
+
+    free(clipboard.text);
+    clipboard.text = editor_block_text(r0, c0, r1, c1, &clipboard.len);
+    if (op == GRENADE_THROW)
+    {
+        editor_del_block(r0, c0, r1, c1);
+        edit_conf.mark_set = 0;
+        editor_set_cursor(r0, c0);
+        editor_set_status("Blasted %d lines", r1 - r0 + 1);
+    }
+    else
+    {
+        editor_set_status("Yanked %d lines", r1 - r0 + 1);
+    }
+}
+
+void snap_to_line_end()
+{
+    if (edit_conf.cy >= edit_conf.numrows)
+    {
+        return;
+    }
+    if (edit_conf.cx > edit_conf.rows[edit_conf.cy + edit_conf.row_offset].size)
+    {
+        edit_conf.cx = edit_conf.rows[edit_conf.cy + edit_conf.row_offset].size;
+    }
+}
+
+/*** keymap ***/
+
+// Every mode owns a dense table from key to action, so dispatching a key is two array lookups.
+// Tables start from keymap_defaults and are then patched by the keymap file, whose lines read
+// "<mode> <key> <action>": for example "insert ^S save" or "all x none". Modes are command,
+// insert, delete, inventory or all; keys are a character, ^X, or a name from keymap_key_names.
+#define KEYMAP_KEYS (256 + DEL_KEY - ARROW_LEFT + 1)
+#define IN(mode) (1 << (mode))
+#define EDITING (IN(MODE_COMMAND) | IN(MODE_INSERT) | IN(MODE_DELETE))
+#define EVERYWHERE (EDITING | IN(MODE_INVENTORY))
+
+enum keymapMode
+{
+    MODE_COMMAND,
+    MODE_INSERT,
+    MODE_DELETE,
+    MODE_INVENTORY,
+    MODE_COUNT,
+};
+
+enum editorAction
+{
+    ACTION_NONE,
+    ACTION_UP,
+    ACTION_DOWN,
+    ACTION_LEFT,
+    ACTION_RIGHT,
+    ACTION_PAGE_UP,
+    ACTION_PAGE_DOWN,
+    ACTION_FAST_TRAVEL,
+    ACTION_INSERT_CHAR,
+    ACTION_NEWLINE,
+    ACTION_BACKSPACE,
+    ACTION_UNDO,
+    ACTION_REDO,
+    ACTION_FOLLOW,
+    ACTION_FIND,
+    ACTION_PIN,
+    ACTION_THROW,
+    ACTION_YANK,
+    ACTION_PUT,
+    ACTION_SAVE,
+    ACTION_QUIT,
+    ACTION_FLEE,
+    ACTION_OPEN_INVENTORY,
+    ACTION_CLOSE_INVENTORY,
+    ACTION_SELECT,
+    ACTION_OPEN_BUFFER,
+    ACTION_NEXT_BUFFER,
+    ACTION_PREV_BUFFER,
+    ACTION_CLOSE_BUFFER,
+    ACTION_COUNT,
+};
+
+typedef struct keymap_action
+{
+    const char *name;
+    void (*run)(void);
+} keymap_action;
+
+typedef struct keymap_binding
+{
+    int modes;
+    int key;
+    int action;
+} keymap_binding;
+
+typedef struct keymap_state
+{
+    unsigned char map[MODE_COUNT][KEYMAP_KEYS];
+    int key;
+} keymap_state;
+keymap_state keymap;
+
+// Movement is shared with the inventory screen, which has no text to snap the cursor to.
+void action_up(void)
+{
+    if (edit_conf.cy != 0)
+        edit_conf.cy--;
+    else if (edit_conf.row_offset > 0)
+        edit_conf.row_offset--;
+    if (!inventory.active)
+        snap_to_line_end();
+}
+
+void action_down(void)
+{
+    if (edit_conf.cy != edit_conf.screen_rows - 1)
+        edit_conf.cy++;
+    else if (edit_conf.row_offset < edit_conf.numrows - edit_conf.screen_rows)
+        edit_conf.row_offset++;
+    if (!inventory.active)
+        snap_to_line_end();
+}
+
+void action_left(void)
+{
+    if (edit_conf.cx != 0)
+        edit_conf.cx--;
+    if (!inventory.active)
+        snap_to_line_end();
+}
+
+void action_right(void)
+{
+    int cols = inventory.active ? edit_conf.screen_cols : editor_text_cols();
+    if (edit_conf.cx != cols - 1)
+        edit_conf.cx++;
+    if (!inventory.active)
+        snap_to_line_end();
+}
+
+void action_page_up(void)
+{
+    if (inventory.fast_travel == 2)
+        editor_page(-1);
+}
+
+void action_page_down(void)
+{
+    if (inventory.fast_travel == 2)
+        editor_page(1);
+}
+
+void action_fast_travel(void)
+{
+    if (inventory.fast_travel == 2)
+        editor_fast_travel();
+}
+
+void action_insert_char(void)
+{
+    editor_insert_char(keymap.key);
+}
+
+void action_follow(void)
+{
+    edit_conf.watch.follow = !edit_conf.watch.follow;
+    if (edit_conf.watch.follow)
+        editor_follow_tail();
+}
+
+void action_grenade(int op)
+{
+    if (inventory.nade == 2)
+        editor_grenade(op);
+}
+
+void action_pin(void)
+{
+    action_grenade(GRENADE_PIN);
+}
+
+void action_throw(void)
+{
+    action_grenade(GRENADE_THROW);
+}
+
+void action_yank(void)
+{
+    action_grenade(GRENADE_YANK);
+}
+
+void action_put(void)
+{
+    action_grenade(GRENADE_PUT);
+}
+
+void action_save(void)
+{
+    edit_conf.save_requested = 1;
+}
+
+// A bare 'q' quits unless the HELMET guards against it.
+void action_flee(void)
+{
+    if (inventory.helmet != 2)
+        editor_quit();
+}
+
+void action_open_inventory(void)
+{
+    inventory.active = 1;
+}
+
+void action_close_inventory(void)
+{
+    inventory.active = 0;
+}
+
+void action_switch_buffer(int index)
+{
+    buffer_switch((index + buffers.count) % buffers.count);
+    editor_set_status("Buffer %d/%d: %s", buffers.current + 1, buffers.count,
+                      edit_conf.file_name ? edit_conf.file_name : "[No Name]");
+}
+
+void action_next_buffer(void)
+{
+    action_switch_buffer(buffers.current + 1);
+}
+
+void action_prev_buffer(void)
+{
+    action_switch_buffer(buffers.current - 1);
+}
+
+// Opening a file that is already open just switches to its buffer.
+void action_open_buffer(void)
+{
+    char *path = editor_prompt("Open: ");
+    if (!path)
+        return;
+    for (int j = 0; j < buffers.count; j++)
+    {
+        char *name = j == buffers.current ? edit_conf.file_name : buffers.parked[j].file_name;
+        if (name && strcmp(name, path) == 0)
+        {
+            action_switch_buffer(j);
+            free(path);
+            return;
+        }
+    }
+
+    buffer_new();
+    if (editor_open(path) == -1)
+    {
+        int error = errno;
+        buffer_close();
+        editor_set_status("Cannot open %s: %s", path, strerror(error));
+    }
+    else
+    {
+        editor_set_status("Buffer %d/%d: %s", buffers.current + 1, buffers.count, path);
+    }
+    free(path);
+}
+
+// Closing a buffer saves it the way quitting does. While its file has changed on disk under
+// unsaved edits the close is refused instead, so the user chooses between saving over the change
+// and quitting, which keeps the edits in the recovery file.
+void action_close_buffer(void)
+{
+    if (buffers.count == 1)
+        editor_quit();
+    if (edit_conf.watch.conflict && edit_conf.edits != edit_conf.saved_edits)
+    {
+        editor_set_status("File changed on disk: ^S saves over it, ^Q keeps the edits aside");
+        return;
+    }
+    editor_flush();
+    buffer_close();
+}
+
+const keymap_action keymap_actions[ACTION_COUNT] = {
+    [ACTION_NONE] = {"none", NULL},
+    [ACTION_UP] = {"up", action_up},
+    [ACTION_DOWN] = {"down", action_down},
+    [ACTION_LEFT] = {"left", action_left},
+    [ACTION_RIGHT] = {"right", action_right},
+    [ACTION_PAGE_UP] = {"page-up", action_page_up},
+    [ACTION_PAGE_DOWN] = {"page-down", action_page_down},
+    [ACTION_FAST_TRAVEL] = {"fast-travel", action_fast_travel},
+    [ACTION_INSERT_CHAR] = {"insert-char", action_insert_char},
+    [ACTION_NEWLINE] = {"newline", editor_insert_newline},
+    [ACTION_BACKSPACE] = {"backspace", editor_del_char},
+    [ACTION_UNDO] = {"undo", editor_undo},
+    [ACTION_REDO] = {"redo", editor_redo},
+    [ACTION_FOLLOW] = {"follow", action_follow},
+    [ACTION_FIND] = {"find", editor_find},
+    [ACTION_PIN] = {"pin", action_pin},
+    [ACTION_THROW] = {"throw", action_throw},
+    [ACTION_YANK] = {"yank", action_yank},
+    [ACTION_PUT] = {"put", action_put},
+    [ACTION_SAVE] = {"save", action_save},
+    [ACTION_QUIT] = {"quit", editor_quit},
+    [ACTION_FLEE] = {"flee", action_flee},
+    [ACTION_OPEN_INVENTORY] = {"inventory", action_open_inventory},
+    [ACTION_CLOSE_INVENTORY] = {"close-inventory", action_close_inventory},
+    [ACTION_SELECT] = {"select", inventory_handle_enter},
+    [ACTION_OPEN_BUFFER] = {"open", action_open_buffer},
+    [ACTION_NEXT_BUFFER] = {"next-buffer", action_next_buffer},
+    [ACTION_PREV_BUFFER] = {"prev-buffer", action_prev_buffer},
+    [ACTION_CLOSE_BUFFER] = {"close-buffer", action_close_buffer},
+};
+
+const keymap_binding keymap_defaults[] = {
+    {EVERYWHERE, ARROW_UP, ACTION_UP},
+    {EVERYWHERE, ARROW_DOWN, ACTION_DOWN},
+    {EVERYWHERE, ARROW_LEFT, ACTION_LEFT},
+    {EVERYWHERE, ARROW_RIGHT, ACTION_RIGHT},
+    {EVERYWHERE & ~IN(MODE_INSERT), 'w', ACTION_UP},
+    {EVERYWHERE & ~IN(MODE_INSERT), 's', ACTION_DOWN},
+    {EVERYWHERE & ~IN(MODE_INSERT), 'a', ACTION_LEFT},
+    {EVERYWHERE & ~IN(MODE_INSERT), 'd', ACTION_RIGHT},
+    {EDITING, PAGE_UP, ACTION_PAGE_UP},
+    {EDITING, PAGE_DOWN, ACTION_PAGE_DOWN},
+    {EDITING, CTRL_KEY('g'), ACTION_FAST_TRAVEL},
+    {EDITING, CTRL_KEY('z'), ACTION_UNDO},
+    {EDITING, CTRL_KEY('y'), ACTION_REDO},
+    {EDITING, CTRL_KEY('t'), ACTION_FOLLOW},
+    {EDITING, CTRL_KEY('f'), ACTION_FIND},
+    {EDITING, CTRL_KEY('n'), ACTION_PIN},
+    {EDITING, CTRL_KEY('x'), ACTION_THROW},
+    {EDITING, CTRL_KEY('k'), ACTION_YANK},
+    {EDITING, CTRL_KEY('v'), ACTION_PUT},
+    {EDITING, '\t', ACTION_OPEN_INVENTORY},
+    {EDITING, CTRL_KEY('o'), ACTION_OPEN_BUFFER},
+    {EDITING, CTRL_KEY('b'), ACTION_NEXT_BUFFER},
+    {EDITING, CTRL_KEY('p'), ACTION_PREV_BUFFER},
+    {EDITING, CTRL_KEY('w'), ACTION_CLOSE_BUFFER},
+    {IN(MODE_COMMAND), CTRL_KEY('q'), ACTION_QUIT},
+    {IN(MODE_COMMAND), 'q', ACTION_FLEE},
+    {IN(MODE_COMMAND), CTRL_KEY('s'), ACTION_SAVE},
+    {IN(MODE_INSERT), '\r', ACTION_NEWLINE},
+    {IN(MODE_DELETE), BACKSPACE, ACTION_BACKSPACE},
+    {IN(MODE_DELETE), CTRL_KEY('h'), ACTION_BACKSPACE},
+    {IN(MODE_INVENTORY), 'q', ACTION_CLOSE_INVENTORY},
+    {IN(MODE_INVENTORY), '\r', ACTION_SELECT},
+};
+
+const struct
+{
+    const char *name;
+    int key;
+} keymap_key_names[] = {
+    {"up", ARROW_UP},
+    {"down", ARROW_DOWN},
+    {"left", ARROW_LEFT},
+    {"right", ARROW_RIGHT},
+    {"pageup", PAGE_UP},
+    {"pagedown", PAGE_DOWN},
+    {"del", DEL_KEY},
+    {"backspace", BACKSPACE},
+    {"enter", '\r'},
+    {"tab", '\t'},
+    {"esc", '\x1b'},
+    {"space", ' '},
+};
+
+const char *keymap_mode_names[MODE_COUNT] = {"command", "insert", "delete", "inventory"};
+
+int keymap_slot(int key)
+{
+    if (key >= 0 && key < 256)
+        return key;
+    if (key >= ARROW_LEFT && key <= DEL_KEY)
+        return 256 + key - ARROW_LEFT;
+    return -1;
+}
+
+void keymap_bind(int modes, int key, int action)
+{
+    int slot = keymap_slot(key);
+    for (int mode = 0; mode < MODE_COUNT && slot != -1; mode++)
+    {
+        if (modes & IN(mode))
+            keymap.map[mode][slot] = action;
+    }
+}
+
+int keymap_parse_key(const char *name)
+{
+    if (name[0] && !name[1])
+        return (unsigned char)name[0];
+    if (name[0] == '^' && name[1] && !name[2])
+        return CTRL_KEY(name[1]);
+    for (size_t j = 0; j < sizeof(keymap_key_names) / sizeof(keymap_key_names[0]); j++)
+    {
+        if (strcmp(name, keymap_key_names[j].name) == 0)
+            return keymap_key_names[j].key;
+    }
+    return -1;
+}
+
+// Applies the keymap file on top of the defaults. Mistakes are reported but never fatal.
+void keymap_load(const char *path, int explicit)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+    {
+        if (explicit)
+            editor_set_status("keymap: cannot open %s", path);
+        return;
+    }
+
+    char line[256];
+    for (int number = 1; fgets(line, sizeof(line), fp); number++)
+    {
+        char mode_name[16], key_name[16], action_name[32];
+        int fields = sscanf(line, "%15s %15s %31s", mode_name, key_name, action_name);
+        if (fields <= 0 || mode_name[0] == '#')
+            continue;
+
+        int modes = 0;
+        for (int mode = 0; mode < MODE_COUNT; mode++)
+        {
+            if (strcmp(mode_name, keymap_mode_names[mode]) == 0)
+                modes = IN(mode);
+        }
+        if (strcmp(mode_name, "all") == 0)
+            modes = EVERYWHERE;
+        int key = fields == 3 ? keymap_parse_key(key_name) : -1;
+        int action = -1;
+        for (int j = 0; fields == 3 && j < ACTION_COUNT; j++)
+        {
+            if (strcmp(action_name, keymap_actions[j].name) == 0)
+                action = j;
+        }
+
+        if (!modes || keymap_slot(key) == -1 || action == -1)
+            editor_set_status("keymap:%d: cannot bind \"%.40s\"", number, strtok(line, "\n"));
+        else
+            keymap_bind(modes, key, action);
+    }
+    fclose(fp);
+}
+
+void keymap_init()
+{
+    // insert mode types every byte nothing else claims, apart from the keys it always ignored
+    for (int key = 0; key < 256; key++)
+        keymap.map[MODE_INSERT][key] = ACTION_INSERT_CHAR;
+    keymap_bind(IN(MODE_INSERT), BACKSPACE, ACTION_NONE);
+    keymap_bind(IN(MODE_INSERT), CTRL_KEY('h'), ACTION_NONE);
+    keymap_bind(IN(MODE_INSERT), CTRL_KEY('l'), ACTION_NONE);
+    keymap_bind(IN(MODE_INSERT), '\x1b', ACTION_NONE);
+
+    for (size_t j = 0; j < sizeof(keymap_defaults) / sizeof(keymap_defaults[0]); j++)
+        keymap_bind(keymap_defaults[j].modes, keymap_defaults[j].key, keymap_defaults[j].action);
+
+    char *path = getenv("RPGEDITOR_KEYMAP");
+    if (path)
+    {
+        keymap_load(path, 1);
+    }
+    else if (getenv("HOME"))
+    {
+        char home_path[PATH_MAX];
+        snprintf(home_path, sizeof(home_path), "%s/.rpgeditor-keys", getenv("HOME"));
+        keymap_load(home_path, 0);
+    }
+}
+
+int keymap_mode()
+{
+    if (inventory.active)
+        return MODE_INVENTORY;
+    if (inventory.command == 2)
+        return MODE_COMMAND;
+    if (inventory.insert == 2)
+        return MODE_INSERT;
+    return MODE_DELETE;
+}
+
+void editor_process_keypress()
+{
+    int key = editor_read_key();
+    for (int j = 0; j < plugins.n_keypress && !inventory.active; j++)
+    {
+        if (plugins.keypress[j](key))
+            return;
+    }
+
+    int slot = keymap_slot(key);
+    if (slot == -1)
+        return;
+    keymap.key = key;
+    void (*run)(void) = keymap_actions[keymap.map[keymap_mode()][slot]].run;
+    if (run)
+        run();
+}
+
+/*** batch ***/
+
+// rpgeditor --batch SCRIPT [-j THREADS] [FILE...] applies an edit script to every file (or to each
+// path read from stdin) without a terminal. Workers take the next file from a shared counter and
+// edit it through their own thread-local edit_conf, so the row functions need no locking. A
+// script line is one of:
+//   replace OLD NEW    every occurrence of OLD becomes NEW
+//   delete TEXT        rows containing TEXT are removed
+//   header TEXT        TEXT is inserted as the first row
+enum batchOp
+{
+    BATCH_REPLACE,
+    BATCH_DELETE,
+    BATCH_HEADER,
+};
+
+typedef struct batch_command
+{
+    int op;
+    char *text;
+    int len;
+    char *with;
+    int with_len;
+} batch_command;
+
+typedef struct batch_run
+{
+    batch_command *commands;
+    int ncommands;
+    char **files;
+    int nfiles;
+
+    pthread_mutex_t lock;
+    int next;
+    int changed;
+    int failed;
+    long long bytes;
+} batch_run;
+
+void batch_replace(batch_command *cmd)
+{
+    for (int j = 0; j < edit_conf.numrows; j++)
+    {
+        editrow *row = &edit_conf.rows[j];
+        char *hit = memmem(row->chars, row->size, cmd->text, cmd->len);
+        if (!hit)
+            continue;
+
+        // cut the row at the first hit, then append the pieces between hits back with NEW in between
+        int from = hit - row->chars;
+        int rest_len = row->size - from;
+        char *rest = malloc(rest_len);
+        memcpy(rest, hit, rest_len);
+        editor_row_del_chars(row, from, rest_len);
+
+        char *end = rest + rest_len;
+        for (char *p = rest; p < end;)
+        {
+            hit = memmem(p, end - p, cmd->text, cmd->len);
+            char *stop = hit ? hit : end;
+            if (stop > p)
+                editor_row_append_string(row, p, stop - p);
+            if (!hit)
+                break;
+            if (cmd->with_len)
+                editor_row_append_string(row, cmd->with, cmd->with_len);
+            p = hit + cmd->len;
+        }
+        free(rest);
+    }
+}
+
+void batch_apply(batch_command *cmd)
+{
+    switch (cmd->op)
+    {
+    case BATCH_REPLACE:
+        batch_replace(cmd);
+        break;
+
+    case BATCH_DELETE:
+        for (int j = edit_conf.numrows - 1; j >= 0; j--)
+        {
+            if (memmem(edit_conf.rows[j].chars, edit_conf.rows[j].size, cmd->text, cmd->len))
+                editor_del_row(j);
+        }
+        break;
+
+    case BATCH_HEADER:
+        editor_insert_row(cmd->text, cmd->len, 0);
+        break;
+    }
+}
+
+void batch_close_document()
+{
+    for (int j = 0; j < edit_conf.numrows; j++)
+        editor_row_free(&edit_conf.rows[j]);
+    free(edit_conf.rows);
+    edit_conf.rows = NULL;
+    edit_conf.numrows = 0;
+    edit_conf.edits = edit_conf.saved_edits = 0;
+    line_index_invalidate();
+    stats_reset(&edit_conf.stats);
+}
+
+void *batch_worker(void *arg)
+{
+    batch_run *run = arg;
+    edit_conf.watch.fd = -1;
+    pool.off = 1;
+    edit_conf.stats.deferred = 1;
+    int changed = 0, failed = 0;
+    long long bytes = 0;
+    while (1)
+    {
+        pthread_mutex_lock(&run->lock);
+        int index = run->next++;
+        pthread_mutex_unlock(&run->lock);
+        if (index >= run->nfiles)
+            break;
+
+        if (editor_load(run->files[index], 0) == -1)
+        {
+            fprintf(stderr, "%s: %s\n", run->files[index], strerror(errno));
+            failed++;
+            continue;
+        }
+        bytes += edit_conf.watch.size;
+        for (int j = 0; j < run->ncommands; j++)
+            batch_apply(&run->commands[j]);
+        if (edit_conf.edits && editor_save() == -1)
+        {
+            fprintf(stderr, "%s: save failed: %s\n", run->files[index], strerror(edit_conf.save_errno));
+            failed++;
+        }
+        else if (edit_conf.edits)
+        {
+            changed++;
+        }
+        batch_close_document();
+    }
+    free(edit_conf.file_name);
+    free(edit_conf.index.chunks);
+    free(edit_conf.index.tree);
+
+    pthread_mutex_lock(&run->lock);
+    run->changed += changed;
+    run->failed += failed;
+    run->bytes += bytes;
+    pthread_mutex_unlock(&run->lock);
+    return NULL;
+}
+
+int batch_parse_script(const char *path, batch_run *run)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+    {
+        perror(path);
+        return -1;
+    }
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    int number = 0, alloc = 0, status = 0;
+    while ((linelen = getline(&line, &linecap, fp)) != -1)
+    {
+        number++;
+        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+            line[--linelen] = '\0';
+        if (linelen == 0 || line[0] == '#')
+            continue;
+
+        batch_command cmd = {0};
+        char *arg = strchr(line, ' ');
+        if (arg)
+            *arg++ = '\0';
+        if (strcmp(line, "replace") == 0 && arg)
+        {
+            cmd.op = BATCH_REPLACE;
+            char *with = strchr(arg, ' ');
+            if (!with || with == arg)
             {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1)
-                    return '\x1b';
-                if (seq[2] == '~')
-                {
-                    switch (seq[1])
-                    {
-                    case '5':
-                        return PAGE_UP;
-                    case '6':
-                        return PAGE_DOWN;
-                    case '3':
-                        return DEL_KEY;
-                    }
-                }
+                fprintf(stderr, "%s:%d: replace needs OLD and NEW\n", path, number);
+                status = -1;
+                continue;
             }
-            else
+            *with++ = '\0';
+            cmd.with = strdup(with);
+            cmd.with_len = strlen(with);
+        }
+        else if (strcmp(line, "delete") == 0 && arg && *arg)
+        {
+            cmd.op = BATCH_DELETE;
+        }
+        else if (strcmp(line, "header") == 0)
+        {
+            cmd.op = BATCH_HEADER;
+        }
+        else
+        {
+            fprintf(stderr, "%s:%d: unknown command \"%s\"\n", path, number, line);
+            status = -1;
+            continue;
+        }
+        cmd.text = strdup(arg ? arg : "");
+        cmd.len = strlen(cmd.text);
+
+        if (run->ncommands == alloc)
+        {
+            alloc = alloc ? alloc * 2 : 8;
+            run->commands = realloc(run->commands, sizeof(batch_command) * alloc);
+        }
+        run->commands[run->ncommands++] = cmd;
+    }
+    free(line);
+    fclose(fp);
+    return status;
+}
+
+int editor_batch(int argc, char *argv[])
+{
+    batch_run run = {0};
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int arg = 3;
+    if (argc < 3 || batch_parse_script(argv[2], &run) == -1)
+    {
+        if (argc < 3)
+            fprintf(stderr, "usage: %s --batch SCRIPT [-j THREADS] [FILE...]\n", argv[0]);
+        return 1;
+    }
+    if (arg + 1 < argc && strcmp(argv[arg], "-j") == 0)
+    {
+        threads = atoi(argv[arg + 1]);
+        arg += 2;
+    }
+    if (threads < 1)
+        threads = 1;
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    int alloc = 0;
+    if (arg < argc)
+    {
+        run.files = &argv[arg];
+        run.nfiles = argc - arg;
+    }
+    else
+    {
+        while ((linelen = getline(&line, &linecap, stdin)) != -1)
+        {
+            if (linelen > 0 && line[linelen - 1] == '\n')
+                line[--linelen] = '\0';
+            if (linelen == 0)
+                continue;
+            if (run.nfiles == alloc)
             {
-                switch (seq[1])
-                {
-                case 'A':
-                    return ARROW_UP;
-                case 'B':
-                    return ARROW_DOWN;
-                case 'C':
-                    return ARROW_RIGHT;
-                case 'D':
-                    return ARROW_LEFT;
-                case '3':
-                    return DEL_KEY;
-                }
+                alloc = alloc ? alloc * 2 : 64;
+                run.files = realloc(run.files, sizeof(char *) * alloc);
             }
+            run.files[run.nfiles++] = strdup(line);
         }
-        return '\x1b';
+        free(line);
+    }
+    if (threads > run.nfiles)
+        threads = run.nfiles > 0 ? run.nfiles : 1;
+
+    pthread_mutex_init(&run.lock, NULL);
+    pthread_t *workers = malloc(sizeof(pthread_t) * threads);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int started = 0;
+    for (int j = 0; j < threads; j++)
+    {
+        if (pthread_create(&workers[started], NULL, batch_worker, &run) == 0)
+            started++;
+    }
+    // the main thread stands in for any worker that could not be started
+    if (started < threads)
+    {
+        batch_worker(&run);
+        threads = started + 1;
+    }
+    for (int j = 0; j < started; j++)
+        pthread_join(workers[j], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    free(workers);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (seconds <= 0)
+        seconds = 1e-9;
+    fprintf(stderr, "%d files (%d changed, %d failed), %.1f MB in %.3f s on %d threads: %.0f files/s, %.1f MB/s\n",
+            run.nfiles, run.changed, run.failed, run.bytes / 1e6, seconds, threads,
+            run.nfiles / seconds, run.bytes / 1e6 / seconds);
+
+    if (arg >= argc)
+    {
+        for (int j = 0; j < run.nfiles; j++)
+            free(run.files[j]);
+        free(run.files);
+    }
+    for (int j = 0; j < run.ncommands; j++)
+    {
+        free(run.commands[j].text);
+        free(run.commands[j].with);
     }
-    return character;
+    free(run.commands);
+    return run.failed ? 1 : 0;
 }
 
-void editor_display_keypress(char character)
+/*** benchmark ***/
+
+#define BENCH_ROWS 10000
+#define BENCH_KEYS 20000
+#define BENCH_LINE 80
+
+void bench_row_changed(int row, int removed, int added)
 {
-    if (iscntrl(character))
+    (void)row;
+    (void)removed;
+    (void)added;
+}
+
+void bench_render_row(int row, const char *chars, int size, unsigned char *colors)
+{
+    (void)row;
+    (void)chars;
+    (void)size;
+    (void)colors;
+}
+
+int bench_keypress(int key)
+{
+    (void)key;
+    return 0;
+}
+
+const rpg_plugin bench_noop_plugin = {RPG_PLUGIN_ABI, "noop", bench_row_changed, bench_render_row, bench_keypress, NULL};
+
+// Presses BENCH_KEYS keys on the visible rows, dispatching keypress hooks and redrawing the text
+// area after each one the way the main loop does, and returns nanoseconds per keystroke.
+double bench_pass()
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int key = 0; key < BENCH_KEYS; key++)
+    {
+        int skip = 0;
+        for (int j = 0; j < plugins.n_keypress; j++)
+            skip |= plugins.keypress[j]('x');
+        if (!skip)
+        {
+            // type and rub out in turn so the document looks the same on every pass
+            editrow *row = &edit_conf.rows[key / 2 % edit_conf.screen_rows];
+            if (key % 2 == 0)
+                editor_row_insert_char(row, 8, 'x');
+            else
+                editor_row_del_char(row, 8);
+        }
+        cache_buffer cb = CBUFFER_INIT;
+        render_editor(&cb);
+        cb_free(&cb);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / BENCH_KEYS;
+}
+
+// Makes every hook call one keystroke makes on the screen bench_pass draws (a keypress, a row
+// change and a render_row per visible row) and nothing else, and returns nanoseconds per keystroke.
+double bench_dispatch_pass()
+{
+    unsigned char colors[BENCH_LINE];
+    volatile int skip = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int key = 0; key < BENCH_KEYS; key++)
+    {
+        for (int j = 0; j < plugins.n_keypress; j++)
+            skip |= plugins.keypress[j]('x');
+        PLUGIN_HOOK(row_changed, key % edit_conf.screen_rows, 1, 1);
+        for (int y = 0; y < edit_conf.screen_rows; y++)
+        {
+            editrow *row = &edit_conf.rows[y];
+            PLUGIN_HOOK(render_row, y, row->chars, row->size, colors);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / BENCH_KEYS;
+}
+
+// Best of a few passes after a warm-up one, so page faults and allocator growth are not billed to the hooks.
+double bench_best(double (*pass)(void))
+{
+    double best = pass();
+    for (int i = 0; i < 3; i++)
+    {
+        double ns = pass();
+        if (ns < best)
+            best = ns;
+    }
+    return best;
+}
+
+// --bench-hooks: keystroke cost with hooks off, with a no-op plugin on every hook and with
+// whatever RPGEDITOR_PLUGINS installs. The dispatch lines time the hook calls on their own,
+// apart from the editing and drawing around them.
+int editor_bench_hooks()
+{
+    edit_conf.screen_rows = 50;
+    edit_conf.screen_cols = 120;
+    edit_conf.watch.fd = -1;
+    journal_init(&edit_conf.journal);
+    for (int j = 0; j < BENCH_ROWS; j++)
+    {
+        char line[BENCH_LINE];
+        int len = snprintf(line, sizeof(line), "\tint value_%d = %d; // \"row %d\"", j, j * 7, j);
+        editor_insert_row(line, len, j);
+    }
+
+    double off = bench_best(bench_pass);
+    printf("hooks off      %8.0f ns/key\n", off);
+
+    plugin_register(&bench_noop_plugin);
+    plugins_enable(1);
+    double noop = bench_best(bench_pass);
+    printf("no-op plugin   %8.0f ns/key (%+.0f)\n", noop, noop - off);
+    printf("  dispatch     %8.0f ns/key\n", bench_best(bench_dispatch_pass));
+
+    plugins.nloaded = 0;
+    if (plugins_load_env())
+    {
+        plugins_enable(1);
+        double loaded = bench_best(bench_pass);
+        printf("%d plugin(s)    %8.0f ns/key (%+.0f)\n", plugins.nloaded, loaded, loaded - off);
+        printf("  dispatch     %8.0f ns/key\n", bench_best(bench_dispatch_pass));
+    }
+    if (edit_conf.status_msg[0])
+        printf("%s\n", edit_conf.status_msg);
+    return 0;
+}
+
+/*** verify ***/
+
+// --verify drives the editor through scripted scenarios with no terminal attached. Every frame
+// refresh_screen would write goes through a small VT100 emulator, the screen it ends up showing
+// is checked against the document, and the bytes each scenario writes are held against a
+// baseline file so a rendering change can't quietly send more. A missing baseline is recorded.
+#define VERIFY_ROWS 24
+#define VERIFY_COLS 80
+#define VERIFY_DOC_ROWS 500
+#define VERIFY_REPORTS 5
+
+typedef struct vt_screen
+{
+    int rows;
+    int cols;
+    char *cells;
+    int row;
+    int col;
+    int cursor_visible;
+    int unknown;
+} vt_screen;
+
+void vt_erase(vt_screen *vt, int from, int to)
+{
+    memset(&vt->cells[from], ' ', to - from);
+}
+
+void vt_put(vt_screen *vt, unsigned char c)
+{
+    // UTF-8 continuation bytes belong to the cell the lead byte took
+    if ((c & 0xc0) == 0x80)
+        return;
+    if (vt->col >= vt->cols)
     {
-        printf("%d\n", character);
+        vt->col = 0;
+        vt->row++;
     }
-    else
+    if (vt->row >= vt->rows)
     {
-        printf("%d ('%c')\r\n", character, character);
+        memmove(vt->cells, &vt->cells[vt->cols], (vt->rows - 1) * vt->cols);
+        vt_erase(vt, (vt->rows - 1) * vt->cols, vt->rows * vt->cols);
+        vt->row = vt->rows - 1;
     }
+    vt->cells[vt->row * vt->cols + vt->col++] = c < 0x80 ? c : '?';
 }
 
-void snap_to_line_end()
+void vt_csi(vt_screen *vt, char private, int *params, int nparams, char final)
 {
-    if (edit_conf.cy >= edit_conf.numrows)
+    int first = nparams > 0 ? params[0] : 0;
+    int at = vt->row * vt->cols + (vt->col < vt->cols ? vt->col : vt->cols - 1);
+    if (private == '?')
     {
+        if (first == 25 && (final == 'h' || final == 'l'))
+            vt->cursor_visible = final == 'h';
+        else
+            vt->unknown++;
         return;
     }
-    if (edit_conf.cx > edit_conf.rows[edit_conf.cy + edit_conf.row_offset].size)
+
+    switch (final)
     {
-        edit_conf.cx = edit_conf.rows[edit_conf.cy + edit_conf.row_offset].size;
+    case 'H':
+        vt->row = (first ? first : 1) - 1;
+        vt->col = (nparams > 1 && params[1] ? params[1] : 1) - 1;
+        break;
+    case 'G':
+        vt->col = (first ? first : 1) - 1;
+        break;
+    case 'K':
+        if (first == 0)
+            vt_erase(vt, at, (vt->row + 1) * vt->cols);
+        else if (first == 1)
+            vt_erase(vt, vt->row * vt->cols, at + 1);
+        else
+            vt_erase(vt, vt->row * vt->cols, (vt->row + 1) * vt->cols);
+        break;
+    case 'J':
+        if (first == 0)
+            vt_erase(vt, at, vt->rows * vt->cols);
+        else if (first == 1)
+            vt_erase(vt, 0, at + 1);
+        else
+            vt_erase(vt, 0, vt->rows * vt->cols);
+        break;
+    case 'm':
+        break;
+    default:
+        vt->unknown++;
+        return;
     }
+    if (vt->row >= vt->rows)
+        vt->row = vt->rows - 1;
+    if (vt->col >= vt->cols)
+        vt->col = vt->cols - 1;
 }
 
-void editor_process_keypress()
+void vt_feed(vt_screen *vt, const char *s, int len)
 {
-    int character_code = editor_read_key();
-
-    if (inventory.command == 2)
+    for (int j = 0; j < len; j++)
     {
-        switch (character_code)
+        if (s[j] == '\r')
         {
-        case CTRL_KEY('q'):
-            refresh_screen();
-            exit(0);
-            break;
-
-        case 'q':
-            if (inventory.helmet != 2)
-            {
-                refresh_screen();
-                exit(0);
-            }
-            break;
-
-        case CTRL_KEY('s'):
-            editor_save();
-            break;
-
-        case ARROW_UP:
-        case 'w':
-            if (edit_conf.cy != 0)
+            vt->col = 0;
+        }
+        else if (s[j] == '\n')
+        {
+            if (vt->row == vt->rows - 1)
             {
-                edit_conf.cy--;
+                memmove(vt->cells, &vt->cells[vt->cols], (vt->rows - 1) * vt->cols);
+                vt_erase(vt, (vt->rows - 1) * vt->cols, vt->rows * vt->cols);
             }
             else
             {
-                if (edit_conf.row_offset > 0)
-                {
-                    edit_conf.row_offset--;
-                }
-            }
-            snap_to_line_end();
-            break;
-
-        case ARROW_LEFT:
-        case 'a':
-            if (edit_conf.cx != 0)
-            {
-                edit_conf.cx--;
+                vt->row++;
             }
-            snap_to_line_end();
-            break;
-
-        case ARROW_DOWN:
-        case 's':
-            if (edit_conf.cy != edit_conf.screen_rows - 1)
+        }
+        else if (s[j] == '\x1b' && j + 1 < len && s[j + 1] == '[')
+        {
+            j += 2;
+            char private = j < len && s[j] == '?' ? s[j++] : 0;
+            int params[8] = {0}, nparams = 0;
+            while (j < len && (isdigit((unsigned char)s[j]) || s[j] == ';'))
             {
-                edit_conf.cy++;
+                if (nparams == 0)
+                    nparams = 1;
+                if (s[j] == ';' && nparams < 8)
+                    nparams++;
+                else if (s[j] != ';')
+                    params[nparams - 1] = params[nparams - 1] * 10 + s[j] - '0';
+                j++;
             }
+            if (j < len)
+                vt_csi(vt, private, params, nparams, s[j]);
             else
-            {
-                if (edit_conf.row_offset < edit_conf.numrows - edit_conf.screen_rows)
-                {
-                    edit_conf.row_offset++;
-                }
-            }
-            snap_to_line_end();
-            break;
-
-        case ARROW_RIGHT:
-        case 'd':
-            if (edit_conf.cx != edit_conf.screen_cols - 1)
-            {
-                edit_conf.cx++;
-            }
-            snap_to_line_end();
-            break;
-
-        case PAGE_UP:
-            if (inventory.fast_travel == 2)
-            {
-                edit_conf.cy = 0;
-                snap_to_line_end();
-            }
-            break;
-
-        case PAGE_DOWN:
-            if (inventory.fast_travel == 2)
-            {
-                edit_conf.cy = edit_conf.screen_rows - 1;
-                snap_to_line_end();
-            }
-            break;
-
-        case CTRL_KEY('I'):
-            inventory.active = 1;
-            break;
+                vt->unknown++;
+        }
+        else if ((unsigned char)s[j] >= ' ' && s[j] != 0x7f)
+        {
+            vt_put(vt, s[j]);
+        }
+        else
+        {
+            vt->unknown++;
         }
     }
+}
 
-    else if (inventory.insert == 2)
-    {
-        switch (character_code)
-        {
-        case ARROW_UP:
-            if (edit_conf.cy != 0)
-            {
-                edit_conf.cy--;
-            }
-            else
-            {
-                if (edit_conf.row_offset > 0)
-                {
-                    edit_conf.row_offset--;
-                }
-            }
-            snap_to_line_end();
-            break;
+typedef struct verify_run
+{
+    vt_screen vt;
+    const char *scenario;
+    int frames;
+    long long bytes;
+    int failures;
+} verify_run;
 
-        case ARROW_LEFT:
-            if (edit_conf.cx != 0)
-            {
-                edit_conf.cx--;
-            }
-            snap_to_line_end();
-            break;
+void verify_fail(verify_run *run, const char *fmt, ...)
+{
+    if (run->failures++ >= VERIFY_REPORTS)
+        return;
+    va_list ap;
+    va_start(ap, fmt);
+    printf("  %s, frame %d: ", run->scenario, run->frames);
+    vprintf(fmt, ap);
+    printf("\n");
+    va_end(ap);
+}
 
-        case ARROW_DOWN:
-            if (edit_conf.cy != edit_conf.screen_rows - 1)
-            {
-                edit_conf.cy++;
-            }
-            else
-            {
-                if (edit_conf.row_offset < edit_conf.numrows - edit_conf.screen_rows)
-                {
-                    edit_conf.row_offset++;
-                }
-            }
-            snap_to_line_end();
-            break;
+// What row `filerow` should look like in the text area: tabs as four spaces, cut at `cols`.
+int verify_expected_row(int filerow, char *out, int cols)
+{
+    int len = 0;
+    editrow *row = &edit_conf.rows[filerow];
+    for (int j = 0; j < row->size && len < cols; j++)
+    {
+        if (row->chars[j] == '\t')
+            for (int k = 0; k < 4 && len < cols; k++)
+                out[len++] = ' ';
+        else
+            out[len++] = (row->chars[j] & 0x80) ? '?' : row->chars[j];
+    }
+    return len;
+}
 
-        case ARROW_RIGHT:
-            if (edit_conf.cx != edit_conf.screen_cols - 1)
-            {
-                edit_conf.cx++;
-            }
-            snap_to_line_end();
-            break;
+// Draws one frame into the emulator and compares what it shows with the editor state.
+void verify_frame(verify_run *run)
+{
+    cache_buffer cb = CBUFFER_INIT;
+    editor_render_frame(&cb);
+    vt_screen *vt = &run->vt;
+    vt_feed(vt, cb.cbuffer, cb.len);
+    run->frames++;
+    run->bytes += cb.len;
+    cb_free(&cb);
 
-        case PAGE_UP:
-            if (inventory.fast_travel == 2)
-            {
-                edit_conf.cy = 0;
-                snap_to_line_end();
-            }
-            break;
+    if (vt->unknown)
+    {
+        verify_fail(run, "%d bytes outside the emulated VT100 subset", vt->unknown);
+        vt->unknown = 0;
+    }
+    if (!vt->cursor_visible)
+        verify_fail(run, "cursor left hidden");
+    if (vt->row != edit_conf.cy || vt->col != (edit_conf.cx < vt->cols ? edit_conf.cx : vt->cols - 1))
+        verify_fail(run, "cursor at %d,%d, editor has %d,%d", vt->row, vt->col, edit_conf.cy, edit_conf.cx);
+    if (inventory.active)
+    {
+        if (memcmp(vt->cells, "---INVENTORY---", 15) != 0)
+            verify_fail(run, "inventory title missing");
+        return;
+    }
 
-        case PAGE_DOWN:
-            if (inventory.fast_travel == 2)
-            {
-                edit_conf.cy = edit_conf.screen_rows - 1;
-                snap_to_line_end();
-            }
-            break;
+    int cols = editor_text_cols();
+    char expect[VERIFY_COLS];
+    for (int y = 0; y < edit_conf.screen_rows; y++)
+    {
+        int filerow = y + edit_conf.row_offset;
+        if (filerow >= edit_conf.numrows && edit_conf.numrows == 0)
+            continue;
+        char *line = &vt->cells[y * vt->cols];
+        int len = filerow < edit_conf.numrows ? verify_expected_row(filerow, expect, cols) : 1;
+        if (filerow >= edit_conf.numrows)
+            expect[0] = '~';
+        memset(&expect[len], ' ', cols - len);
+        if (memcmp(line, expect, cols) != 0)
+            verify_fail(run, "screen row %d shows \"%.*s\", file row %d is \"%.*s\"", y, cols, line, filerow, cols, expect);
+        if (cols < edit_conf.screen_cols && line[cols] != '|')
+            verify_fail(run, "screen row %d has no minimap border", y);
+    }
 
-        case '\r':
-            editor_insert_newline();
-            break;
+    char position[32];
+    int len = snprintf(position, sizeof(position), "%d/%d", edit_conf.cy + 1 + edit_conf.row_offset, edit_conf.numrows);
+    char *status = &vt->cells[edit_conf.screen_rows * vt->cols];
+    if (memcmp(&status[vt->cols - len], position, len) != 0)
+        verify_fail(run, "status bar \"%.*s\" does not end in %s", vt->cols, status, position);
+}
 
-        case CTRL_KEY('I'):
-            inventory.active = 1;
-            break;
+// A fresh document mixing short, empty, tabbed and over-wide rows.
+void verify_document()
+{
+    buffer_release();
+    editor_init_document();
+    edit_conf.screen_rows = VERIFY_ROWS - 1;
+    edit_conf.screen_cols = VERIFY_COLS;
+    edit_conf.loading++;
+    for (int j = 0; j < VERIFY_DOC_ROWS; j++)
+    {
+        char line[200];
+        int len;
+        if (j % 11 == 0)
+            len = 0;
+        else if (j % 7 == 0)
+            len = snprintf(line, sizeof(line), "\tif (row_%d)\t\treturn %d;", j, j * 3);
+        else if (j % 13 == 0)
+            len = snprintf(line, sizeof(line), "%d %0150d", j, j);
+        else
+            len = snprintf(line, sizeof(line), "row %d: the quick brown fox jumps over the lazy dog", j);
+        editor_insert_row(line, len, j);
+    }
+    edit_conf.loading--;
+}
 
-        case BACKSPACE:
-        case CTRL_KEY('h'):
-        case CTRL_KEY('l'):
-        case '\x1b':
-            // DO NOT DO ANYTHING
-            break;
+void verify_open(verify_run *run)
+{
+    verify_frame(run);
+}
 
-        default:
-            editor_insert_char(character_code);
-            break;
-        }
+void verify_scroll(verify_run *run)
+{
+    for (int j = 0; j < 60; j++)
+    {
+        action_down();
+        verify_frame(run);
     }
-
-    else
+    for (int j = 0; j < 30; j++)
     {
-        switch (character_code)
-        {
-        case ARROW_UP:
-        case 'w':
-            if (edit_conf.cy != 0)
-            {
-                edit_conf.cy--;
-            }
-            else
-            {
-                if (edit_conf.row_offset > 0)
-                {
-                    edit_conf.row_offset--;
-                }
-            }
-            snap_to_line_end();
-            break;
-
-        case ARROW_LEFT:
-        case 'a':
-            if (edit_conf.cx != 0)
-            {
-                edit_conf.cx--;
-            }
-            snap_to_line_end();
-            break;
-
-        case ARROW_DOWN:
-        case 's':
-            if (edit_conf.cy != edit_conf.screen_rows - 1)
-            {
-                edit_conf.cy++;
-            }
-            else
-            {
-                if (edit_conf.row_offset < edit_conf.numrows - edit_conf.screen_rows)
-                {
-                    edit_conf.row_offset++;
-                }
-            }
-            snap_to_line_end();
-            break;
+        action_up();
+        verify_frame(run);
+    }
+}
 
-        case ARROW_RIGHT:
-        case 'd':
-            if (edit_conf.cx != edit_conf.screen_cols - 1)
-            {
-                edit_conf.cx++;
-            }
-            snap_to_line_end();
-            break;
+void verify_page(verify_run *run)
+{
+    for (int j = 0; j < 10; j++)
+    {
+        editor_page(1);
+        verify_frame(run);
+    }
+    editor_page(-1);
+    verify_frame(run);
+}
 
-        case PAGE_UP:
-            if (inventory.fast_travel == 2)
-            {
-                edit_conf.cy = 0;
-                snap_to_line_end();
-            }
-            break;
+void verify_type(verify_run *run)
+{
+    editor_set_cursor(5, 10);
+    for (int j = 0; j < 40; j++)
+    {
+        editor_insert_char("typing "[j % 7]);
+        verify_frame(run);
+    }
+    for (int j = 0; j < 20; j++)
+    {
+        editor_del_char();
+        verify_frame(run);
+    }
+}
 
-        case PAGE_DOWN:
-            if (inventory.fast_travel == 2)
-            {
-                edit_conf.cy = edit_conf.screen_rows - 1;
-                snap_to_line_end();
-            }
-            break;
+void verify_newline(verify_run *run)
+{
+    editor_set_cursor(3, 4);
+    for (int j = 0; j < 10; j++)
+    {
+        editor_insert_newline();
+        verify_frame(run);
+    }
+}
 
-        case BACKSPACE:
-        case CTRL_KEY('h'):
-            editor_del_char();
-            break;
+void verify_block(verify_run *run)
+{
+    editor_del_block(2, 3, 9, 5);
+    verify_frame(run);
+    editor_undo();
+    verify_frame(run);
+    editor_put_block(4, 0, "one\n\ttwo\nthree ", 15);
+    verify_frame(run);
+}
 
-        case CTRL_KEY('I'):
-            inventory.active = 0;
-            break;
-        }
+void verify_minimap(verify_run *run)
+{
+    inventory.map = 2;
+    for (int j = 0; j < 40; j++)
+    {
+        action_down();
+        verify_frame(run);
     }
+    editor_page(1);
+    verify_frame(run);
+    inventory.map = 0;
+    verify_frame(run);
 }
 
-void inventory_process_keypress()
+void verify_inventory(verify_run *run)
 {
-    int character_code = editor_read_key();
-    switch (character_code)
+    inventory.active = 1;
+    edit_conf.cy = 0;
+    verify_frame(run);
+    for (int j = 0; j < 3; j++)
     {
-    case 'q':
-        inventory.active = 0;
-        break;
+        action_down();
+        verify_frame(run);
+    }
+    inventory.active = 0;
+    edit_conf.cy = 0;
+    verify_frame(run);
+}
 
-    case ARROW_UP:
-    case 'w':
-        if (edit_conf.cy != 0)
+// Statistics kept by the row mutators must match counting the document again from scratch.
+int verify_stats_match(const char *when)
+{
+    doc_stats fresh = {0};
+    stats_add_rows(&fresh, edit_conf.rows, 0, edit_conf.numrows);
+    doc_stats *st = &edit_conf.stats;
+    int bucket = 0;
+    while (bucket < STATS_BUCKETS - 1 && fresh.histogram[bucket] == st->histogram[bucket])
+        bucket++;
+    int ok = fresh.bytes == st->bytes && fresh.words == st->words && fresh.chars == st->chars &&
+             fresh.longest == st->longest && fresh.nlong == st->nlong &&
+             fresh.histogram[bucket] == st->histogram[bucket];
+    if (!ok)
+        printf("  stats, %s: %lld bytes, %lld words, longest %d, %lld in bucket %d; a recount has %lld, %lld, %d, %lld\n",
+               when, st->bytes, st->words, st->longest, st->histogram[bucket], bucket,
+               fresh.bytes, fresh.words, fresh.longest, fresh.histogram[bucket]);
+    stats_reset(&fresh);
+    return ok;
+}
+
+// Opens a file big enough for stats_compute to split it across threads, with rows on both sides
+// of STATS_EXACT, then edits the long rows. Returns the number of failed checks.
+int verify_stats()
+{
+    char path[] = "/tmp/rpgverifyXXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1)
+    {
+        printf("  stats: %s\n", strerror(errno));
+        return 1;
+    }
+    FILE *fp = fdopen(fd, "w");
+    for (int j = 0; j < 2 * STATS_PARALLEL_ROWS + 1000; j++)
+    {
+        if (j % 10000 == 5)
         {
-            edit_conf.cy--;
+            for (int k = 0; k < STATS_EXACT + j % 7; k++)
+                fputc(k % 9 ? 'w' : ' ', fp);
+            fputc('\n', fp);
         }
         else
         {
-            if (edit_conf.row_offset > 0)
-            {
-                edit_conf.row_offset--;
-            }
+            fputs(j % 3 ? "a b\n" : "\n", fp);
         }
-        break;
+    }
+    fclose(fp);
 
-    case ARROW_LEFT:
-    case 'a':
-        if (edit_conf.cx != 0)
-        {
-            edit_conf.cx--;
-        }
-        break;
+    buffer_release();
+    editor_init_document();
+    int failed = 0;
+    if (editor_open(path) == -1)
+    {
+        printf("  stats: cannot open %s\n", path);
+        failed++;
+    }
+    else
+    {
+        failed += !verify_stats_match("after editor_open");
+        editor_del_row(5);
+        failed += !verify_stats_match("after deleting a long row");
+        char *wide = malloc(STATS_EXACT + 100);
+        memset(wide, 'x', STATS_EXACT + 100);
+        editor_insert_row(wide, STATS_EXACT + 100, 0);
+        free(wide);
+        editor_row_del_chars(&edit_conf.rows[10005], 0, 3);
+        failed += !verify_stats_match("after inserting and shortening long rows");
+    }
+    buffer_release();
+    unlink(path);
+    return failed;
+}
 
-    case ARROW_DOWN:
-    case 's':
-        if (edit_conf.cy != edit_conf.screen_rows - 1)
-        {
-            edit_conf.cy++;
-        }
-        else
+typedef struct verify_scenario
+{
+    const char *name;
+    void (*run)(verify_run *run);
+} verify_scenario;
+
+const verify_scenario verify_scenarios[] = {
+    {"open", verify_open},
+    {"scroll", verify_scroll},
+    {"page", verify_page},
+    {"type", verify_type},
+    {"newline", verify_newline},
+    {"block", verify_block},
+    {"minimap", verify_minimap},
+    {"inventory", verify_inventory},
+};
+
+// Lines of "<scenario> <frames> <bytes>".
+int verify_baseline_lookup(FILE *fp, const char *name, int *frames, long long *bytes)
+{
+    if (!fp)
+        return 0;
+    rewind(fp);
+    char line[128], scenario[64];
+    while (fgets(line, sizeof(line), fp))
+        if (sscanf(line, "%63s %d %lld", scenario, frames, bytes) == 3 && strcmp(scenario, name) == 0)
+            return 1;
+    return 0;
+}
+
+int editor_verify(const char *baseline_path)
+{
+    FILE *baseline = baseline_path ? fopen(baseline_path, "r") : NULL;
+    FILE *record = baseline_path && !baseline ? fopen(baseline_path, "w") : NULL;
+    int nscenarios = sizeof(verify_scenarios) / sizeof(verify_scenarios[0]);
+    int failed = 0;
+    editor_init_document();
+
+    printf("%-10s %6s %9s %9s %9s\n", "scenario", "frames", "bytes", "B/frame", "baseline");
+    for (int s = 0; s < nscenarios; s++)
+    {
+        verify_document();
+        verify_run run = {0};
+        run.scenario = verify_scenarios[s].name;
+        run.vt.rows = VERIFY_ROWS;
+        run.vt.cols = VERIFY_COLS;
+        run.vt.cells = malloc(VERIFY_ROWS * VERIFY_COLS);
+        vt_erase(&run.vt, 0, VERIFY_ROWS * VERIFY_COLS);
+        verify_scenarios[s].run(&run);
+
+        int base_frames;
+        long long base_bytes;
+        char verdict[48] = "";
+        if (verify_baseline_lookup(baseline, run.scenario, &base_frames, &base_bytes))
         {
-            if (edit_conf.row_offset < edit_conf.numrows - edit_conf.screen_rows)
-            {
-                edit_conf.row_offset++;
-            }
+            if (base_frames != run.frames || run.bytes > base_bytes)
+                run.failures++;
+            if (base_frames != run.frames)
+                snprintf(verdict, sizeof(verdict), "(baseline has %d frames)", base_frames);
+            else
+                snprintf(verdict, sizeof(verdict), "%9lld %+.1f%%%s", base_bytes, 100.0 * (run.bytes - base_bytes) / base_bytes,
+                         run.bytes > base_bytes ? " REGRESSED" : "");
         }
-        break;
-
-    case ARROW_RIGHT:
-    case 'd':
-        if (edit_conf.cx != edit_conf.screen_cols - 1)
+        if (record)
+            fprintf(record, "%s %d %lld\n", run.scenario, run.frames, run.bytes);
+        printf("%-10s %6d %9lld %9lld %s\n", run.scenario, run.frames, run.bytes, run.bytes / run.frames, verdict);
+        if (run.failures)
         {
-            edit_conf.cx++;
+            printf("  %s: %d failure(s)\n", run.scenario, run.failures);
+            failed++;
         }
-        break;
-
-    case '\r':
-        inventory_handle_enter();
-        break;
+        free(run.vt.cells);
     }
+    int stats_failures = verify_stats();
+    printf("%-10s %s\n", "stats", stats_failures ? "DIFFERS FROM RECOUNT" : "matches recount");
+    if (stats_failures)
+        failed++;
+    if (record)
+        printf("baseline recorded in %s\n", baseline_path);
+    if (baseline)
+        fclose(baseline);
+    if (record)
+        fclose(record);
+    return failed ? 1 : 0;
 }
 
 /*** init ***/
 
 int main(int argc, char *argv[])
 {
+    if (argc >= 2 && strcmp(argv[1], "--bench-hooks") == 0)
+        return editor_bench_hooks();
+    if (argc >= 2 && strcmp(argv[1], "--batch") == 0)
+        return editor_batch(argc, argv);
+    if (argc >= 2 && strcmp(argv[1], "--verify") == 0)
+        return editor_verify(argc >= 3 ? argv[2] : NULL);
+
     enable_raw_mode();
     if (get_window_size(&edit_conf.screen_rows, &edit_conf.screen_cols) == -1)
         die("get_window_size");
 
-    edit_conf.cx = 0;
-    edit_conf.cy = 0;
-    edit_conf.row_offset = 0;
-    edit_conf.numrows = 0;
-    edit_conf.rows = NULL;
     edit_conf.screen_rows--;
-    edit_conf.file_name = NULL;
+    editor_init_document();
 
     // 0 -> not owned; 1 -> owned; 2 -> active
     inventory.insert = 1;
@@ -973,22 +5637,27 @@ int main(int argc, char *argv[])
     inventory.helmet = 0;
     inventory.active = 0;
 
-    if (argc >= 2)
+    if (plugins_load_env())
     {
-        editor_open(argv[1]);
+        inventory.dlc = 2;
+        plugins_enable(1);
     }
 
+    for (int j = 1; j < argc; j++)
+    {
+        if (j > 1)
+            buffer_new();
+        if (editor_open(argv[j]) == -1)
+            die("fopen");
+    }
+    buffer_switch(0);
+
+    keymap_init();
     refresh_screen();
     while (1)
     {
-        if (inventory.active)
-        {
-            inventory_process_keypress();
-        }
-        else
-        {
-            editor_process_keypress();
-        }
+        editor_process_keypress();
+        editor_tick_buffers();
         refresh_screen();
     }
     return 0;
@@ -0,0 +1,37 @@
+#ifndef RPGEDITOR_PLUGIN_H
+#define RPGEDITOR_PLUGIN_H
+
+// A plugin is a shared object exporting rpg_plugin_init. The editor loads every path listed in
+// RPGEDITOR_PLUGINS (colon separated) at startup, hands each one the host table below and keeps
+// the returned descriptor for the life of the process. Any hook may be left NULL.
+#define RPG_PLUGIN_ABI 1
+
+// Rows [row, row + removed) were replaced by `added` rows; an edit inside one row is (row, 1, 1).
+typedef void (*rpg_row_changed_hook)(int row, int removed, int added);
+// Fills colors[0..size) for the row about to be drawn: 0 keeps the default, 1-7 are ANSI colours.
+typedef void (*rpg_render_row_hook)(int row, const char *chars, int size, unsigned char *colors);
+// Returns nonzero to swallow the key before the editor sees it.
+typedef int (*rpg_keypress_hook)(int key);
+typedef void (*rpg_saved_hook)(const char *file_name);
+
+typedef struct rpg_host
+{
+    int abi;
+    int (*numrows)(void);
+    const char *(*row)(int index, int *size);
+    void (*set_status)(const char *fmt, ...);
+} rpg_host;
+
+typedef struct rpg_plugin
+{
+    int abi;
+    const char *name;
+    rpg_row_changed_hook row_changed;
+    rpg_render_row_hook render_row;
+    rpg_keypress_hook keypress;
+    rpg_saved_hook saved;
+} rpg_plugin;
+
+typedef const rpg_plugin *(*rpg_plugin_init_fn)(const rpg_host *host);
+
+#endif